@@ -0,0 +1,52 @@
+#!/bin/sh
+# Round trip through sizes past 32 bits: generate a corpus of huge lines,
+# edit it in batch mode, then compare with the expected bytes streamed
+# from the shell. The editor holds text and render for every row, so
+# this needs about 2 * BIG_MB + LINE_MB of RAM and 2 * BIG_MB of disk.
+#
+#   BIG_MB   corpus size in MB, default 4400 (past 4 GB)
+#   LINE_MB  size of each huge line in MB, default 2100 (past 2 GB)
+#   DIR      scratch directory, default $TMPDIR or /tmp
+#   KILO     editor binary, default ./kilo
+set -e
+BIG_MB=${BIG_MB:-4400}
+LINE_MB=${LINE_MB:-2100}
+DIR=${DIR:-${TMPDIR:-/tmp}}
+KILO=${KILO:-./kilo}
+
+CORPUS="$DIR/kilo-big.txt"
+WORK="$DIR/kilo-big-work.txt"
+SCRIPT="$DIR/kilo-big.kb"
+CACHE="$DIR/kilo-big-cache"
+trap 'rm -rf "$CORPUS" "$WORK" "$SCRIPT" "$CACHE"' EXIT
+
+# Huge lines of a repeating pattern separated by short ones; the last
+# line has no newline, which a save adds
+gen(){
+	printf 'first line\twith a tab\n'
+	made=0
+	i=0
+	while [ $made -lt "$BIG_MB" ]; do
+		n=$LINE_MB
+		[ $((BIG_MB - made)) -lt "$n" ] && n=$((BIG_MB - made))
+		yes 'kilo-0123456789' | tr -d '\n' | head -c $((n * 1048576))
+		printf '\nshort line %d\n' $i
+		made=$((made + n))
+		i=$((i + 1))
+	done
+	printf 'last line, no newline'
+}
+
+echo "generating $BIG_MB MB corpus, $LINE_MB MB lines"
+gen > "$CORPUS"
+cp "$CORPUS" "$WORK"
+printf 'i 1 START\na END\n' > "$SCRIPT"
+
+# getline load, then the mmap load that writes and reuses the sidecar
+echo "batch edit"
+"$KILO" -b "$SCRIPT" "$WORK"
+{ printf 'START\n'; cat "$CORPUS"; printf '\nEND\n'; } | cmp - "$WORK"
+echo "batch edit with line index cache"
+XDG_CACHE_HOME="$CACHE" "$KILO" -b "$SCRIPT" -c "$WORK"
+{ printf 'START\nSTART\n'; cat "$CORPUS"; printf '\nEND\nEND\n'; } | cmp - "$WORK"
+echo "PASS"
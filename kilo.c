@@ -12,14 +12,33 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <poll.h>
 #include <time.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
 
 /*** defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define KILO_VERSION "0.0.1"
 #define TAB_STOP 8
 #define QUIT_TIMES 3 
+#define IDLE_SLICE_USEC 2000 //longest an idle task may hold off a keypress
+#define HEX_LINE 16 //bytes per hex view line
+#define SORT_PAR_MIN 65536 //smaller ranges are sorted on the calling thread
+#define FILTER_PAR_MIN 16384 //smaller buffers are scanned on the calling thread
+// Identifier index cap: at most 2^19 slots (4 MB), 2^18 entries of at
+// most WORDS_MAX_LEN bytes (about 20 MB with malloc overhead) and the
+// sorted view (4 MB)
+#define WORDS_MAX (1 << 18)
+#define WORDS_MIN_LEN 3 //shorter identifiers are not worth completing
+#define WORDS_MAX_LEN 64 //longer runs are data, not names
+#define WORDS_STEP 16384 //bytes indexed between slice deadline checks
+#define COMPLETE_MAX 64 //candidates offered per completion
+#define SPILL_EVERY 4096 //rows loaded between memory budget checks
 
 enum editorKey{
 	BACKSPACE = 127,
@@ -36,41 +55,202 @@ enum editorKey{
 /*** data ***/
 
 typedef struct erow{
-	int size;
-	int rsize;
+	ssize_t size;
+	ssize_t rsize;
 	char *strings;
 	char *render;
+	//clean copy of strings: below the buffer's maplen an offset into its
+	//file mapping, else maplen plus an offset into the swap file; -1 once
+	//edited. strings and render are NULL until the row is faulted in, and
+	//rsize is -1 if it never was.
+	off_t store;
 } erow;
 
-struct editorConfig{
-	int cx, cy;
-	int rx; //Render field horizontal position
+//Identifier with a use count so rows can be re-indexed on edit. Entries
+//never move, so the sorted view can point at them; one whose count drops
+//to 0 stays until the table is compacted.
+struct wordEntry{
+	uint32_t len;
+	uint32_t count; //occurrences in indexed rows
+	char word[];
+};
+
+struct wordIndex{
+	struct wordEntry **slots; //open addressing, NULL empty
+	size_t cap; //power of two
+	size_t nentries; //in slots, counts of 0 included
+	size_t nwords; //entries with a count
+	size_t bytes; //slots, entries and sorted view
+	struct wordEntry **sorted; //every entry by word, for prefix lookups
+	size_t nsorted;
+	struct wordEntry **fresh; //added since sorted was last merged
+	size_t nfresh, freshcap;
+	ssize_t progress; //rows [0, progress) are indexed
+	ssize_t rowpos, rowrpos; //bytes of row progress indexed, in strings and render
+	int midword; //rowpos is inside an identifier too long to index
+	int full; //WORDS_MAX reached, new words are skipped
+};
+
+//Ctrl-N state, continued while the cursor stays right after the insertion
+struct completion{
+	struct editorBuffer *buf;
+	ssize_t cy;
+	ssize_t start; //column where the word begins
+	size_t prefixlen, insertedlen;
+	int dirty; //buf->dirty after our last insertion
+	char *cands[COMPLETE_MAX];
+	int ncands, next;
+};
+
+//Last sort/uniq/reverse, undoable until the buffer changes again
+struct rowUndo{
+	ssize_t at;
+	ssize_t oldlen, newlen;
+	erow *saved; //the oldlen rows as they were, text shared with live rows
+	erow *removed; //rows uniq dropped, owned here until undone or discarded
+	ssize_t nremoved;
+	int dirty; //B->dirty right after the command
+};
+
+struct hexPatch{
+	size_t off;
+	unsigned char byte;
+};
+
+//One open file, keeps its own cursor and scroll while in the background
+struct editorBuffer{
+	ssize_t cx, cy;
+	ssize_t rx; //Render field horizontal position
 	//scroll
-	int rowoff;
-	int coloff;
-	//window size
-	int screenrows;
-	int screencols;
+	ssize_t rowoff;
+	ssize_t coloff;
+	//soft wrap
+	int softwrap;
+	ssize_t vrowoff; //first visible screen line
+	ssize_t *wrapidx; //Fenwick tree over per-row screen lines
+	ssize_t wrapn; //rows wrapidx has room for
+	int wrapcols; //width wrapidx was built for, 0 when stale
+	ssize_t wrapfrom; //nodes past this row are stale
+	ssize_t wraptotal; //screen lines of all rows
 	//number of rows
-	int nrows;
+	ssize_t nrows;
+	ssize_t rowcap; //allocated slots in row
+	//rows outside [spilllo, spillhi] and below spilltail are all spilled
+	ssize_t spilllo, spillhi;
+	ssize_t spilltail; //rows from here on were added since the last spill
 	int dirty;
+	int loaded; //0 until the file is first switched to
 	char *filename;
+	//the file as loaded through the line index, rows fault in from it
+	char *map;
+	size_t maplen;
+	//hex view of a mapped binary file, rows stay empty
+	int hex;
+	int hexfd;
+	int hexro; //opened read-only, patching disabled
+	unsigned char *hexmap;
+	size_t hexsize;
+	size_t hexcur; //cursor byte offset
+	size_t hextop; //offset of the first visible line
+	int hexnibble; //1 once the high nibble of hexcur was typed
+	struct hexPatch *patches; //unsaved bytes, sorted by offset
+	size_t npatches, patchcap;
+	struct rowUndo *undo;
+	//grep view: only rows containing filter are shown, rowoff counts view rows
+	char *filter;
+	size_t filterlen;
+	ssize_t *fidx; //matching row numbers, ascending
+	ssize_t nf, fcap;
+	struct wordIndex *words; //built on first Ctrl-N
+	//buffer contains text lines
+	erow *row;
+};
+
+//Size-class allocator shared by the row text of every buffer
+#define POOL_CLASSES 9 //16 bytes .. 4 KB
+#define POOL_CHUNK (64 * 1024)
+
+struct rowPool{
+	void *freelist[POOL_CLASSES];
+	void *chunks; //every chunk, linked through its first word
+	char *chunk; //bump region of the current chunk
+	size_t chunkleft;
+	size_t inuse; //bytes handed out, headers included
+};
+
+//Cooperative idle task: do a bounded amount of work, return 0 when finished
+typedef int (*idleFn)(void *arg);
+
+struct idleTask{
+	idleFn fn;
+	void *arg;
+};
+
+struct tpool;
+
+//Worker thread job, done runs back on the main thread
+struct schedJob{
+	void (*fn)(void *arg);
+	void (*done)(void *arg);
+	void *arg;
+	struct schedJob *next;
+};
+
+struct editorConfig{
+	//window size
+	int screenrows;
+	int screencols;
+	volatile sig_atomic_t winch; //set by SIGWINCH
 	//Status message 
 	char statusmsg[80];
 	time_t statusmsg_time;
-	//buffer contains text lines
-	erow *row;
+	//open buffers
+	struct editorBuffer **bufs;
+	int nbufs;
+	int curbuf;
+	struct rowPool pool;
+	int batch; //no terminal, messages go to stderr
+	int idxcache; //reuse line-offset sidecars across opens
+	//row text beyond membudget bytes is spilled, 0 for no limit
+	size_t membudget;
+	int swapfd; //unlinked swap file, -1 until the first spill
+	off_t swapend;
+	//idle-time scheduler
+	struct idleTask *tasks;
+	int ntasks;
+	int nexttask; //round robin position
+	uint64_t slice_end; //deadline of the running slice
+	struct tpool *workers; //tpoolShared
+	pthread_mutex_t donelock;
+	struct schedJob *done; //finished jobs awaiting their callback
+	int donepipe[2]; //wakes the idle loop when a job finishes
+	int jobs; //submitted jobs whose callback has not run
+	struct completion complete;
 	struct termios orig_termios;
 };
 
 struct editorConfig E;
+//Per thread so batch workers can each drive their own buffer
+__thread struct editorBuffer *B; //current buffer, E.bufs[E.curbuf]
+__thread struct rowPool *P; //allocator for B's rows, &E.pool when interactive
 
 /*** prototypes ***/
 
 void editorUpdateRow(erow *row);
+void editorRenderRow(erow *row);
+void editorFreeRow(erow *row);
+void editorRowUndoDiscard();
 void editorAppendRow(char *s, size_t len);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorSave();
+void editorRefreshScreen();
+void editorScroll();
+void editorHandleResize();
+void schedRunIdle();
+int editorOpen(char *filename);
+int editorSwitchBuffer(int i);
+int editorAnyDirty();
+char *editorPrompt(char *prompt);
 
 /*** terminal ***/
 void bust(const char *s){
@@ -104,8 +284,10 @@ void enableRawMode(){
 int editorReadKey(){
 	int nread;
 	char c;
+	schedRunIdle();
 	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) bust("read");
+		if (nread == -1 && errno != EAGAIN && errno != EINTR) bust("read");
+		if (E.winch) editorHandleResize();
 	}
 	if (c == '\x1b'){
 		char seq[3];
@@ -179,120 +361,1690 @@ int getWindowSize(int *rows, int *cols){
 	}
 }
 
+/*** row pool ***/
+
+// Each block is prefixed with its size; pooled sizes are powers of two
+#define POOL_MAX ((size_t)16 << (POOL_CLASSES - 1))
+
+void *poolAlloc(size_t n){
+	size_t need = n + sizeof(size_t);
+	size_t size = 16;
+	int cls = 0;
+	while (cls < POOL_CLASSES && size < need){
+		size *= 2;
+		cls++;
+	}
+	size_t *h;
+	if (cls == POOL_CLASSES){
+		size = need;
+		h = malloc(size);
+		if (h == NULL) bust("malloc");
+	} else if (P->freelist[cls]){
+		h = P->freelist[cls];
+		P->freelist[cls] = *(void **)h;
+	} else {
+		if (P->chunkleft < size){
+			// First 16 bytes link the chunk list and keep blocks aligned
+			void **c = malloc(POOL_CHUNK);
+			if (c == NULL) bust("malloc");
+			*c = P->chunks;
+			P->chunks = c;
+			P->chunk = (char *)c + 16;
+			P->chunkleft = POOL_CHUNK - 16;
+		}
+		h = (size_t *)P->chunk;
+		P->chunk += size;
+		P->chunkleft -= size;
+	}
+	*h = size;
+	P->inuse += size;
+	return h + 1;
+}
+
+void poolFree(void *p){
+	if (p == NULL) return;
+	size_t *h = (size_t *)p - 1;
+	size_t size = *h;
+	P->inuse -= size;
+	if (size > POOL_MAX){
+		free(h);
+		return;
+	}
+	int cls = 0;
+	while (((size_t)16 << cls) < size) cls++;
+	*(void **)h = P->freelist[cls];
+	P->freelist[cls] = h;
+}
+
+void *poolRealloc(void *p, size_t n){
+	if (p == NULL) return poolAlloc(n);
+	size_t *h = (size_t *)p - 1;
+	size_t size = *h;
+	if (n + sizeof(size_t) <= size) return p;
+	if (size > POOL_MAX){
+		// Large rows grow through realloc so glibc can extend them in place
+		size_t *new = realloc(h, n + sizeof(size_t));
+		if (new == NULL) bust("realloc");
+		*new = n + sizeof(size_t);
+		P->inuse += *new - size;
+		return new + 1;
+	}
+	char *new = poolAlloc(n);
+	memcpy(new, p, size - sizeof(size_t));
+	poolFree(p);
+	return new;
+}
+
+// Release every chunk at once; large blocks must already be freed
+void poolDestroy(struct rowPool *pool){
+	while (pool->chunks){
+		void **c = pool->chunks;
+		pool->chunks = *c;
+		free(c);
+	}
+	memset(pool, 0, sizeof(*pool));
+}
+
+/*** row spill ***/
+
+// Once the row pool passes E.membudget, rows far from the cursor are
+// written to a swap file and freed; editorRow reads them back on access
+
+int editorSwapOpen(){
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0') dir = "/tmp";
+	size_t len = strlen(dir) + sizeof("/kilo-swap-XXXXXX");
+	char *path = malloc(len);
+	if (path == NULL) bust("malloc");
+	snprintf(path, len, "%s/kilo-swap-XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd != -1) unlink(path);
+	free(path);
+	if (fd == -1) return -1;
+	E.swapfd = fd;
+	E.swapend = 0;
+	return 0;
+}
+
+// pread/pwrite move at most ~2 GB per call, loop until done
+int ioFull(int fd, int wr, char *buf, size_t len, off_t off){
+	while (len){
+		ssize_t n = wr ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+// Rows edited since their last spill are appended, the rest only freed
+int editorRowSpill(erow *row){
+	if (row->strings == NULL) return 0;
+	if (row->store == -1){
+		if (ioFull(E.swapfd, 1, row->strings, row->size, E.swapend) == -1) return -1;
+		row->store = B->maplen + E.swapend;
+		E.swapend += row->size;
+	}
+	editorFreeRow(row);
+	row->strings = NULL;
+	row->render = NULL;
+	return 0;
+}
+
+void editorRowFault(erow *row){
+	row->strings = poolAlloc(row->size + 1);
+	if ((size_t)row->store < B->maplen) memcpy(row->strings, B->map + row->store, row->size);
+	else if (ioFull(E.swapfd, 0, row->strings, row->size, row->store - B->maplen) == -1) bust("pread");
+	row->strings[row->size] = '\0';
+	row->render = NULL;
+	editorRenderRow(row);
+}
+
+// Row at may be resident again
+void editorSpillTouch(ssize_t at){
+	if (at >= B->spilltail) return;
+	if (at < B->spilllo) B->spilllo = at;
+	if (at > B->spillhi) B->spillhi = at;
+}
+
+// Keep the cursors on their rows across an insert (dir 1) or delete
+// (dir -1) at row at
+void editorSpillShift(ssize_t at, int dir){
+	if (at >= B->spilltail) return;
+	B->spilltail += dir;
+	if (at < B->spilllo) B->spilllo += dir;
+	if (at <= B->spillhi) B->spillhi += dir;
+	if (dir > 0) editorSpillTouch(at);
+}
+
+// Row commands move rows around wholesale
+void editorSpillReset(){
+	B->spilllo = 0;
+	B->spillhi = B->nrows - 1;
+	B->spilltail = B->nrows;
+}
+
+// Every access to row text goes through here
+erow *editorRow(ssize_t at){
+	erow *row = &B->row[at];
+	if (row->strings == NULL){
+		editorRowFault(row);
+		editorSpillTouch(at);
+	}
+	return row;
+}
+
+void editorFaultRows(ssize_t at, ssize_t len){
+	ssize_t i;
+	for (i = 0; i < len; i++) editorRow(at + i);
+}
+
+// Bytes [off, off + len) of a row without faulting it in, for readers
+// that must not touch the pool: mapped rows are read in place, spilled
+// ones into *scratch
+const char *editorRowText(struct editorBuffer *buf, erow *row, ssize_t off, ssize_t len, char **scratch, size_t *cap){
+	if (row->strings) return row->strings + off;
+	if ((size_t)row->store < buf->maplen) return buf->map + row->store + off;
+	if ((size_t)len > *cap){
+		*cap = len;
+		*scratch = realloc(*scratch, *cap);
+		if (*scratch == NULL) bust("realloc");
+	}
+	if (ioFull(E.swapfd, 0, *scratch, len, row->store - buf->maplen + off) == -1) bust("pread");
+	return *scratch;
+}
+
+int editorSpillOne(erow *row){
+	// The undo snapshot shares row text, so it cannot outlive a spill
+	editorRowUndoDiscard();
+	return editorRowSpill(row);
+}
+
+// Spill B's rows outside [klo, khi), farthest first. Rows added since the
+// last pass are taken first and each visited once; the rest are walked
+// inward from the cursors, so spilled rows are never scanned twice.
+int editorSpillRows(ssize_t klo, ssize_t khi, size_t target){
+	ssize_t i;
+	for (i = B->nrows - 1; i >= B->spilltail; i--){
+		erow *row = &B->row[i];
+		if (row->strings == NULL) continue;
+		if (i >= klo && i < khi){
+			if (i > B->spillhi) B->spillhi = i;
+			if (i < B->spilllo) B->spilllo = i;
+			continue;
+		}
+		if (P->inuse <= target){
+			// Rows below i are unvisited, count them all as resident
+			if (i > B->spillhi) B->spillhi = i;
+			if (B->spilltail < B->spilllo) B->spilllo = B->spilltail;
+			break;
+		}
+		if (editorSpillOne(row) == -1) return -1;
+	}
+	B->spilltail = B->nrows;
+	while (B->spilllo <= B->spillhi && P->inuse > target){
+		erow *row;
+		if (B->spilllo < klo && (B->spillhi < khi || klo - B->spilllo > B->spillhi - khi))
+			row = &B->row[B->spilllo++];
+		else if (B->spillhi >= khi) row = &B->row[B->spillhi--];
+		else break;
+		if (editorSpillOne(row) == -1) return -1;
+	}
+	return 0;
+}
+
+// Row tables can't be spilled, so they come out of the budget
+size_t editorSpillFixed(){
+	size_t bytes = 0;
+	int i;
+	for (i = 0; i < E.nbufs; i++)
+		bytes += E.bufs[i]->rowcap * sizeof(erow) + E.bufs[i]->wrapn * sizeof(ssize_t);
+	return bytes;
+}
+
+// Background buffers go first, then rows away from the cursor; spilling
+// down to 7/8 of the budget keeps this off most keypresses
+void editorSpillCold(){
+	if (E.membudget == 0 || E.batch) return;
+	size_t fixed = editorSpillFixed();
+	if (P->inuse + fixed <= E.membudget) return;
+	if (E.swapfd == -1 && editorSwapOpen() == -1){
+		editorSetStatusMessage("Can't create swap file: %s", strerror(errno));
+		return;
+	}
+	size_t target = E.membudget / 8 * 7;
+	target = target > fixed ? target - fixed : 0;
+	struct editorBuffer *cur = B;
+	int err = 0;
+	int i;
+	for (i = 0; i < E.nbufs && !err && P->inuse > target; i++){
+		if (E.bufs[i] == cur) continue;
+		B = E.bufs[i];
+		err = editorSpillRows(0, 0, target);
+	}
+	B = cur;
+	ssize_t keep = 2 * E.screenrows;
+	if (!err) err = editorSpillRows(B->cy - keep, B->cy + keep, target);
+	if (err) editorSetStatusMessage("Can't write swap file: %s", strerror(errno));
+}
+
+/*** thread pool ***/
+
+// Each worker owns a deque: it pops its newest task and steals the oldest
+// task from a sibling when its own deque runs dry
+typedef void (*tpoolFn)(void *arg);
+
+// Tasks of one call, so callers sharing a pool wait only for their own
+struct tpoolGroup{
+	ssize_t pending; //under the pool lock
+};
+
+struct tpoolTask{
+	tpoolFn fn;
+	void *arg;
+	struct tpoolGroup *group; //NULL when not waited on by group
+};
+
+struct tpoolDeque{
+	pthread_mutex_t lock;
+	struct tpoolTask *tasks;
+	ssize_t head, tail, cap;
+};
+
+struct tpool{
+	int nthreads;
+	pthread_t *threads;
+	struct tpoolDeque *deques;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; //tasks were queued or stop was set
+	pthread_cond_t done; //pending or a group's pending dropped to 0
+	ssize_t queued; //sitting in a deque
+	ssize_t pending; //queued or running
+	int next; //round robin target for outside submits
+	int stop;
+};
+
+__thread int tpoolWorker = -1; //deque index of the calling worker
+
+struct tpoolArg{
+	struct tpool *pool;
+	int id;
+};
+
+int tpoolTake(struct tpool *pool, int id, struct tpoolTask *t){
+	int i;
+	for (i = 0; i < pool->nthreads; i++){
+		struct tpoolDeque *d = &pool->deques[(id + i) % pool->nthreads];
+		int got = 0;
+		pthread_mutex_lock(&d->lock);
+		if (d->head < d->tail){
+			if (i == 0) *t = d->tasks[--d->tail];
+			else *t = d->tasks[d->head++];
+			got = 1;
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (got) return 1;
+	}
+	return 0;
+}
+
+void *tpoolMain(void *arg){
+	struct tpoolArg a = *(struct tpoolArg *)arg;
+	struct tpool *pool = a.pool;
+	struct tpoolTask t;
+	free(arg);
+	tpoolWorker = a.id;
+	while (1){
+		if (tpoolTake(pool, a.id, &t)){
+			pthread_mutex_lock(&pool->lock);
+			pool->queued--;
+			pthread_mutex_unlock(&pool->lock);
+			t.fn(t.arg);
+			pthread_mutex_lock(&pool->lock);
+			int wake = --pool->pending == 0;
+			if (t.group && --t.group->pending == 0) wake = 1;
+			if (wake) pthread_cond_broadcast(&pool->done);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued == 0 && !pool->stop)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		int stop = pool->stop && pool->queued == 0;
+		pthread_mutex_unlock(&pool->lock);
+		if (stop) return NULL;
+	}
+}
+
+struct tpool *tpoolCreate(int nthreads){
+	struct tpool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) bust("calloc");
+	if (nthreads < 1) nthreads = 1;
+	pool->nthreads = nthreads;
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	pool->deques = calloc(nthreads, sizeof(struct tpoolDeque));
+	if (pool->threads == NULL || pool->deques == NULL) bust("calloc");
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	int i;
+	for (i = 0; i < nthreads; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
+	for (i = 0; i < nthreads; i++){
+		struct tpoolArg *a = malloc(sizeof(*a));
+		if (a == NULL) bust("malloc");
+		a->pool = pool;
+		a->id = i;
+		if (pthread_create(&pool->threads[i], NULL, tpoolMain, a) != 0) bust("pthread_create");
+	}
+	return pool;
+}
+
+// Workers push onto their own deque, everyone else spreads round robin.
+// The task is counted before it is visible, so a worker that takes it at
+// once can never drive queued below zero.
+void tpoolSubmitGroup(struct tpool *pool, struct tpoolGroup *group, tpoolFn fn, void *arg){
+	pthread_mutex_lock(&pool->lock);
+	int id = tpoolWorker >= 0 ? tpoolWorker : pool->next++ % pool->nthreads;
+	pool->pending++;
+	pool->queued++;
+	if (group) group->pending++;
+	pthread_mutex_unlock(&pool->lock);
+
+	struct tpoolDeque *d = &pool->deques[id];
+	pthread_mutex_lock(&d->lock);
+	if (d->head > 0 && d->tail == d->cap){
+		memmove(d->tasks, &d->tasks[d->head], sizeof(struct tpoolTask) * (d->tail - d->head));
+		d->tail -= d->head;
+		d->head = 0;
+	}
+	if (d->tail == d->cap){
+		d->cap = d->cap ? d->cap * 2 : 16;
+		d->tasks = realloc(d->tasks, sizeof(struct tpoolTask) * d->cap);
+		if (d->tasks == NULL) bust("realloc");
+	}
+	d->tasks[d->tail].fn = fn;
+	d->tasks[d->tail].arg = arg;
+	d->tasks[d->tail].group = group;
+	d->tail++;
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void tpoolSubmit(struct tpool *pool, tpoolFn fn, void *arg){
+	tpoolSubmitGroup(pool, NULL, fn, arg);
+}
+
+void tpoolWait(struct tpool *pool){
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void tpoolWaitGroup(struct tpool *pool, struct tpoolGroup *group){
+	pthread_mutex_lock(&pool->lock);
+	while (group->pending > 0) pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void tpoolDestroy(struct tpool *pool){
+	int i;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+	for (i = 0; i < pool->nthreads; i++){
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->done);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+int tpoolDefaultThreads(){
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+// One pool for every interactive command, started on first use and kept
+// until exit so a sort doesn't pay for creating and joining threads
+struct tpool *tpoolShared(){
+	if (E.workers == NULL) E.workers = tpoolCreate(tpoolDefaultThreads());
+	return E.workers;
+}
+
+/*** scheduler ***/
+
+uint64_t nowUsec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Idle tasks poll this between units of work and return once it is true
+int schedExpired(){
+	return nowUsec() >= E.slice_end;
+}
+
+void schedAddTask(idleFn fn, void *arg){
+	struct idleTask *tasks = realloc(E.tasks, sizeof(struct idleTask) * (E.ntasks + 1));
+	if (tasks == NULL) bust("realloc");
+	E.tasks = tasks;
+	E.tasks[E.ntasks].fn = fn;
+	E.tasks[E.ntasks].arg = arg;
+	E.ntasks++;
+}
+
+void schedRemoveTask(idleFn fn, void *arg){
+	int i;
+	for (i = 0; i < E.ntasks; i++){
+		if (E.tasks[i].fn == fn && E.tasks[i].arg == arg){
+			memmove(&E.tasks[i], &E.tasks[i + 1], sizeof(struct idleTask) * (E.ntasks - i - 1));
+			E.ntasks--;
+			i--;
+		}
+	}
+}
+
+void schedJobMain(void *arg){
+	struct schedJob *job = arg;
+	job->fn(job->arg);
+	pthread_mutex_lock(&E.donelock);
+	job->next = E.done;
+	E.done = job;
+	pthread_mutex_unlock(&E.donelock);
+	char c = 0;
+	write(E.donepipe[1], &c, 1);
+}
+
+// Run fn on the shared pool; done (if any) runs later on the main thread
+void schedSubmitJob(void (*fn)(void *), void (*done)(void *), void *arg){
+	struct schedJob *job = malloc(sizeof(*job));
+	if (job == NULL) bust("malloc");
+	job->fn = fn;
+	job->done = done;
+	job->arg = arg;
+	E.jobs++;
+	tpoolSubmit(tpoolShared(), schedJobMain, job);
+}
+
+// Deliver finished jobs, returns how many callbacks ran
+int schedReapJobs(){
+	char drain[64];
+	while (read(E.donepipe[0], drain, sizeof(drain)) > 0);
+	pthread_mutex_lock(&E.donelock);
+	struct schedJob *job = E.done;
+	E.done = NULL;
+	pthread_mutex_unlock(&E.donelock);
+	int n = 0;
+	while (job){
+		struct schedJob *next = job->next;
+		if (job->done) job->done(job->arg);
+		free(job);
+		E.jobs--;
+		n++;
+		job = next;
+	}
+	return n;
+}
+
+// Block until every job has finished and delivered, e.g. before exit
+void schedWaitJobs(){
+	struct pollfd pfd;
+	pfd.fd = E.donepipe[0];
+	pfd.events = POLLIN;
+	while (E.jobs){
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) return;
+		schedReapJobs();
+	}
+}
+
+// Called before blocking for a key: hand out IDLE_SLICE_USEC slices to
+// idle tasks and deliver job results until input arrives or nothing is left
+void schedRunIdle(){
+	struct pollfd fds[2];
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = E.donepipe[0];
+	fds[1].events = POLLIN;
+	while (E.ntasks || E.jobs){
+		// Only wait when there is no idle task to run
+		int ready = poll(fds, 2, E.ntasks ? 0 : -1);
+		if (ready == -1 && errno == EINTR){
+			if (E.winch) editorHandleResize();
+			continue;
+		}
+		if (ready > 0 && (fds[0].revents & POLLIN)) return;
+		if (ready > 0 && (fds[1].revents & POLLIN) && schedReapJobs()) editorRefreshScreen();
+		if (E.ntasks == 0) continue;
+
+		E.nexttask %= E.ntasks;
+		struct idleTask t = E.tasks[E.nexttask];
+		E.slice_end = nowUsec() + IDLE_SLICE_USEC;
+		if (t.fn(t.arg)){
+			E.nexttask++;
+		} else {
+			schedRemoveTask(t.fn, t.arg);
+			editorRefreshScreen();
+		}
+	}
+}
+
+/*** soft wrap ***/
+
+ssize_t editorWrapLines(ssize_t rsize){
+	return rsize ? (rsize + E.screencols - 1) / E.screencols : 1;
+}
+
+// Render width, worked out from the mapping for a row never faulted in
+ssize_t editorRowWidth(erow *row){
+	if (row->rsize >= 0) return row->rsize;
+	const char *s = B->map + row->store;
+	ssize_t j, w = 0;
+	for (j = 0; j < row->size; j++) w = s[j] == '\t' ? (w / TAB_STOP + 1) * TAB_STOP : w + 1;
+	row->rsize = w;
+	return w;
+}
+
+void editorWrapBuild(ssize_t upto);
+
+// Screen lines taken by rows [0, at)
+ssize_t editorWrapPrefix(ssize_t at){
+	if (B->wrapcols != E.screencols || at > B->wrapfrom) editorWrapBuild(at);
+	ssize_t sum = 0;
+	for (; at > 0; at -= at & -at) sum += B->wrapidx[at];
+	return sum;
+}
+
+// Make the nodes for rows [0, upto) valid. Row inserts and deletes only
+// mark the rows after them stale, and queries rebuild just as far as
+// they look, so an edit near the cursor costs about a screenful; a
+// resize rebuilds from the start.
+void editorWrapBuild(ssize_t upto){
+	ssize_t i;
+	if (upto > B->nrows) upto = B->nrows;
+	if (B->wrapcols != E.screencols){
+		B->wrapcols = E.screencols;
+		B->wrapfrom = 0;
+		B->wraptotal = 0;
+		for (i = 0; i < B->nrows; i++) B->wraptotal += editorWrapLines(editorRowWidth(&B->row[i]));
+	}
+	ssize_t from = B->wrapfrom;
+	if (from >= upto) return;
+	if (B->wrapn < B->nrows){
+		ssize_t *idx = realloc(B->wrapidx, sizeof(ssize_t) * (B->nrows + 1));
+		if (idx == NULL) bust("realloc");
+		B->wrapidx = idx;
+		B->wrapn = B->nrows;
+	}
+	ssize_t *idx = B->wrapidx;
+	for (i = from + 1; i <= upto; i++) idx[i] = editorWrapLines(editorRowWidth(&B->row[i - 1]));
+	for (i = from + 1; i <= upto; i++){
+		ssize_t j = i + (i & -i);
+		if (j <= upto) idx[j] += idx[i];
+	}
+	// Nodes reaching back before from still lack rows (i - lowbit, from],
+	// which the valid nodes below from sum up
+	ssize_t head = editorWrapPrefix(from);
+	for (i = from + 1; i <= upto; i++){
+		ssize_t lo = i - (i & -i);
+		if (lo < from) idx[i] += head - editorWrapPrefix(lo);
+	}
+	B->wrapfrom = upto;
+}
+
+// Rows from at on moved; their nodes are rebuilt when next queried
+void editorWrapInvalidate(ssize_t at){
+	if (at < B->wrapfrom) B->wrapfrom = at;
+}
+
+// Row text changed: patch its screen line count in O(log n)
+void editorWrapUpdateRow(erow *row, ssize_t oldrsize){
+	// Never built (batch mode has no screen): the first build counts all
+	if (B->wrapcols == 0) return;
+	ssize_t at = row - B->row;
+	ssize_t delta = editorWrapLines(row->rsize) - editorWrapLines(oldrsize);
+	B->wraptotal += delta;
+	if (delta == 0 || B->wrapcols != E.screencols || at < 0 || at >= B->wrapfrom) return;
+	ssize_t i;
+	for (i = at + 1; i <= B->wrapfrom; i += i & -i) B->wrapidx[i] += delta;
+}
+
+// Row holding screen line vline, *sub is the line within that row
+ssize_t editorWrapFind(ssize_t vline, ssize_t *sub){
+	if (vline >= editorWrapPrefix(B->wrapfrom)) editorWrapBuild(B->nrows);
+	ssize_t pos = 0;
+	ssize_t step = 1;
+	while (step * 2 <= B->wrapfrom) step *= 2;
+	for (; step; step /= 2){
+		if (pos + step <= B->wrapfrom && B->wrapidx[pos + step] <= vline){
+			pos += step;
+			vline -= B->wrapidx[pos];
+		}
+	}
+	*sub = vline;
+	return pos;
+}
+
+// Screen line of the cursor and its column within that line
+ssize_t editorWrapCursor(ssize_t *x){
+	ssize_t vline = editorWrapPrefix(B->cy);
+	*x = B->rx;
+	if (B->cy < B->nrows){
+		ssize_t sub = B->rx / E.screencols;
+		ssize_t last = editorWrapLines(editorRowWidth(&B->row[B->cy])) - 1;
+		if (sub > last) sub = last;
+		vline += sub;
+		*x = B->rx - sub * E.screencols;
+		// After the last character of a row that fills its last line
+		if (*x >= E.screencols) *x = E.screencols - 1;
+	}
+	return vline;
+}
+
+void editorToggleSoftWrap(){
+	ssize_t sub;
+	if (B->filter){
+		editorSetStatusMessage("Soft wrap is off in a filtered view");
+		return;
+	}
+	B->softwrap = !B->softwrap;
+	if (B->softwrap){
+		B->vrowoff = editorWrapPrefix(B->rowoff);
+	} else {
+		B->rowoff = editorWrapFind(B->vrowoff, &sub);
+		B->coloff = 0;
+	}
+	editorSetStatusMessage("Soft wrap %s", B->softwrap ? "on" : "off");
+}
+
+/*** grep view ***/
+
+struct filterJob{
+	struct editorBuffer *buf; //B is per thread, so workers get it here
+	ssize_t lo, hi;
+	ssize_t *hits;
+	ssize_t nhits, cap;
+	char *scratch; //spilled row text, workers can't fault rows in
+	size_t scratchcap;
+};
+
+int editorTextMatches(struct editorBuffer *buf, const char *text, ssize_t len){
+	return memmem(text, len, buf->filter, buf->filterlen) != NULL;
+}
+
+int editorRowMatches(struct editorBuffer *buf, erow *row){
+	return editorTextMatches(buf, row->strings, row->size);
+}
+
+void filterScan(void *arg){
+	struct filterJob *job = arg;
+	ssize_t j;
+	for (j = job->lo; j < job->hi; j++){
+		erow *row = &job->buf->row[j];
+		const char *text = editorRowText(job->buf, row, 0, row->size, &job->scratch, &job->scratchcap);
+		if (!editorTextMatches(job->buf, text, row->size)) continue;
+		if (job->nhits == job->cap){
+			job->cap = job->cap ? job->cap * 2 : 256;
+			job->hits = realloc(job->hits, sizeof(ssize_t) * job->cap);
+			if (job->hits == NULL) bust("realloc");
+		}
+		job->hits[job->nhits++] = j;
+	}
+}
+
+// Full rescan, only for new patterns and bulk row commands: each worker
+// scans a slice of rows and the slices are concatenated in order
+void editorFilterBuild(){
+	int nthreads = tpoolDefaultThreads();
+	int njobs = B->nrows < FILTER_PAR_MIN ? 1 : nthreads;
+	struct filterJob *jobs = calloc(njobs, sizeof(struct filterJob));
+	if (jobs == NULL) bust("calloc");
+	int i;
+	for (i = 0; i < njobs; i++){
+		jobs[i].buf = B;
+		jobs[i].lo = B->nrows * i / njobs;
+		jobs[i].hi = B->nrows * (i + 1) / njobs;
+	}
+	if (njobs == 1){
+		filterScan(&jobs[0]);
+	} else {
+		struct tpool *pool = tpoolShared();
+		struct tpoolGroup group = {0};
+		for (i = 0; i < njobs; i++) tpoolSubmitGroup(pool, &group, filterScan, &jobs[i]);
+		tpoolWaitGroup(pool, &group);
+	}
+	B->nf = 0;
+	for (i = 0; i < njobs; i++) B->nf += jobs[i].nhits;
+	if (B->nf > B->fcap){
+		B->fcap = B->nf;
+		B->fidx = realloc(B->fidx, sizeof(ssize_t) * B->fcap);
+		if (B->fidx == NULL) bust("realloc");
+	}
+	ssize_t n = 0;
+	for (i = 0; i < njobs; i++){
+		memcpy(&B->fidx[n], jobs[i].hits, sizeof(ssize_t) * jobs[i].nhits);
+		n += jobs[i].nhits;
+		free(jobs[i].hits);
+		free(jobs[i].scratch);
+	}
+	free(jobs);
+}
+
+// Position of the first view entry at or after file row at
+ssize_t editorRowToView(ssize_t at){
+	if (!B->filter) return at;
+	ssize_t lo = 0, hi = B->nf;
+	while (lo < hi){
+		ssize_t mid = (lo + hi) / 2;
+		if (B->fidx[mid] < at) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+ssize_t editorViewToRow(ssize_t v){
+	if (!B->filter) return v;
+	return v < B->nf ? B->fidx[v] : B->nrows;
+}
+
+ssize_t editorViewRows(){
+	return B->filter ? B->nf : B->nrows;
+}
+
+// File row dir view rows away from at, clamped to [0, nrows]
+ssize_t editorViewStep(ssize_t at, int dir){
+	ssize_t v = editorRowToView(at) + dir;
+	if (v < 0) v = 0;
+	if (v > editorViewRows()) v = editorViewRows();
+	return editorViewToRow(v);
+}
+
+void editorFilterAdd(ssize_t at){
+	ssize_t v = editorRowToView(at);
+	if (v < B->nf && B->fidx[v] == at) return;
+	if (B->nf == B->fcap){
+		B->fcap = B->fcap ? B->fcap * 2 : 256;
+		B->fidx = realloc(B->fidx, sizeof(ssize_t) * B->fcap);
+		if (B->fidx == NULL) bust("realloc");
+	}
+	memmove(&B->fidx[v + 1], &B->fidx[v], sizeof(ssize_t) * (B->nf - v));
+	B->fidx[v] = at;
+	B->nf++;
+}
+
+void editorFilterRemove(ssize_t at){
+	ssize_t v = editorRowToView(at);
+	if (v >= B->nf || B->fidx[v] != at) return;
+	memmove(&B->fidx[v], &B->fidx[v + 1], sizeof(ssize_t) * (B->nf - v - 1));
+	B->nf--;
+}
+
+// Row text changed: re-test just that row. The cursor row stays visible
+// so it does not vanish while being typed into.
+void editorFilterUpdateRow(erow *row){
+	if (!B->filter) return;
+	ssize_t at = row - B->row;
+	if (at < 0 || at >= B->nrows) return;
+	if (editorRowMatches(B, row)) editorFilterAdd(at);
+	else if (at != B->cy) editorFilterRemove(at);
+}
+
+// Rows at or after at moved by delta; O(matches after at), no rescan
+void editorFilterShift(ssize_t at, ssize_t delta){
+	if (!B->filter) return;
+	ssize_t v;
+	for (v = editorRowToView(at); v < B->nf; v++) B->fidx[v] += delta;
+}
+
+// Bulk row commands reorder rows, so the view is rebuilt and the cursor
+// snapped back onto a visible row
+void editorFilterRefresh(){
+	if (!B->filter) return;
+	editorFilterBuild();
+	B->cy = editorViewToRow(editorRowToView(B->cy));
+}
+
+void editorFilterClear(){
+	B->rowoff = editorViewToRow(B->rowoff);
+	free(B->filter);
+	B->filter = NULL;
+	B->nf = 0;
+	editorSetStatusMessage("Filter cleared");
+}
+
+// Ctrl-F: show only rows containing a string, Ctrl-F again shows all rows
+void editorFilter(){
+	if (B->filter){
+		editorFilterClear();
+		return;
+	}
+	char *q = editorPrompt("Filter: %s (ESC to cancel)");
+	if (q == NULL) return;
+	B->softwrap = 0;
+	B->filter = q;
+	B->filterlen = strlen(q);
+	editorFilterBuild();
+	B->cy = editorViewToRow(editorRowToView(B->cy));
+	B->cx = 0;
+	B->rowoff = 0;
+	B->coloff = 0;
+	editorSetStatusMessage("%zd matching lines (Ctrl-F to clear)", B->nf);
+}
+
+/*** word index ***/
+
+uint64_t fnv1a(const char *s, size_t len){
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++){
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+int isIdentChar(int c){
+	return isalnum(c) || c == '_';
+}
+
+// Slot holding word, or the empty slot to insert it into
+struct wordEntry **wordFind(struct wordIndex *wi, const char *s, size_t len){
+	size_t mask = wi->cap - 1;
+	size_t i = fnv1a(s, len) & mask;
+	while (1){
+		struct wordEntry *e = wi->slots[i];
+		if (e == NULL || (e->len == len && memcmp(e->word, s, len) == 0)) return &wi->slots[i];
+		i = (i + 1) & mask;
+	}
+}
+
+void wordRehash(struct wordIndex *wi, size_t cap){
+	struct wordEntry **old = wi->slots;
+	size_t oldcap = wi->cap;
+	wi->slots = calloc(cap, sizeof(struct wordEntry *));
+	if (wi->slots == NULL) bust("calloc");
+	wi->cap = cap;
+	wi->bytes += cap * sizeof(struct wordEntry *);
+	wi->bytes -= oldcap * sizeof(struct wordEntry *);
+	size_t i;
+	for (i = 0; i < oldcap; i++)
+		if (old[i]) *wordFind(wi, old[i]->word, old[i]->len) = old[i];
+	free(old);
+}
+
+int wordCmp(const void *a, const void *b){
+	return strcmp((*(struct wordEntry **)a)->word, (*(struct wordEntry **)b)->word);
+}
+
+// Sort fresh entries and fold them into the sorted view. Unless forced,
+// the O(n) merge waits until they are a sixteenth of it; lookups search
+// both runs meanwhile.
+void wordMerge(struct wordIndex *wi, int force){
+	if (wi->nfresh == 0) return;
+	qsort(wi->fresh, wi->nfresh, sizeof(struct wordEntry *), wordCmp);
+	if (!force && wi->nfresh * 16 < wi->nsorted) return;
+	struct wordEntry **out = malloc(sizeof(struct wordEntry *) * (wi->nsorted + wi->nfresh));
+	if (out == NULL) bust("malloc");
+	size_t i = 0, j = 0, k = 0;
+	while (i < wi->nsorted && j < wi->nfresh)
+		out[k++] = wordCmp(&wi->fresh[j], &wi->sorted[i]) < 0 ? wi->fresh[j++] : wi->sorted[i++];
+	while (i < wi->nsorted) out[k++] = wi->sorted[i++];
+	while (j < wi->nfresh) out[k++] = wi->fresh[j++];
+	free(wi->sorted);
+	wi->sorted = out;
+	wi->nsorted = k;
+	wi->bytes += wi->nfresh * sizeof(struct wordEntry *);
+	wi->nfresh = 0;
+}
+
+// Free entries whose count dropped to 0, done only once the cap is hit
+void wordCompact(struct wordIndex *wi){
+	wordMerge(wi, 1);
+	size_t i, k = 0;
+	for (i = 0; i < wi->nsorted; i++){
+		struct wordEntry *e = wi->sorted[i];
+		if (e->count){
+			wi->sorted[k++] = e;
+			continue;
+		}
+		wi->bytes -= sizeof(struct wordEntry) + e->len + 1 + sizeof(struct wordEntry *);
+		free(e);
+	}
+	wi->nsorted = wi->nentries = k;
+	memset(wi->slots, 0, sizeof(struct wordEntry *) * wi->cap);
+	for (i = 0; i < k; i++) *wordFind(wi, wi->sorted[i]->word, wi->sorted[i]->len) = wi->sorted[i];
+}
+
+void wordAdd(struct wordIndex *wi, const char *s, size_t len){
+	if ((wi->nentries + 1) * 2 > wi->cap) wordRehash(wi, wi->cap * 2);
+	struct wordEntry **slot = wordFind(wi, s, len);
+	if (*slot){
+		if ((*slot)->count++ == 0) wi->nwords++;
+		return;
+	}
+	if (wi->nentries >= WORDS_MAX){
+		if (wi->nwords == wi->nentries){
+			wi->full = 1;
+			return;
+		}
+		wordCompact(wi);
+		slot = wordFind(wi, s, len);
+	}
+	struct wordEntry *e = malloc(sizeof(struct wordEntry) + len + 1);
+	if (e == NULL) bust("malloc");
+	e->len = len;
+	e->count = 1;
+	memcpy(e->word, s, len);
+	e->word[len] = '\0';
+	*slot = e;
+	if (wi->nfresh == wi->freshcap){
+		wi->freshcap = wi->freshcap ? wi->freshcap * 2 : 256;
+		wi->fresh = realloc(wi->fresh, sizeof(struct wordEntry *) * wi->freshcap);
+		if (wi->fresh == NULL) bust("realloc");
+	}
+	wi->fresh[wi->nfresh++] = e;
+	wi->nentries++;
+	wi->nwords++;
+	wi->bytes += sizeof(struct wordEntry) + len + 1;
+}
+
+void wordRemove(struct wordIndex *wi, const char *s, size_t len){
+	struct wordEntry *e = *wordFind(wi, s, len);
+	if (e && e->count && --e->count == 0) wi->nwords--;
+}
+
+// Add (dir > 0) or drop every identifier in text
+void wordIndexText(struct wordIndex *wi, const char *text, ssize_t len, int dir){
+	ssize_t i = 0;
+	while (i < len){
+		if (!isIdentChar((unsigned char)text[i])){
+			i++;
+			continue;
+		}
+		ssize_t start = i;
+		while (i < len && isIdentChar((unsigned char)text[i])) i++;
+		if (isdigit((unsigned char)text[start]) || i - start < WORDS_MIN_LEN || i - start > WORDS_MAX_LEN) continue;
+		if (dir > 0) wordAdd(wi, &text[start], i - start);
+		else wordRemove(wi, &text[start], i - start);
+	}
+}
+
+// Idle task: index rows in order, WORDS_STEP bytes at a time so a
+// multi-MB row can't hold off a keypress. Raw text is indexed, tabs are
+// not identifier characters so it splits the same as render.
+int wordsBuildStep(void *arg){
+	static char *scratch;
+	static size_t cap;
+	struct editorBuffer *buf = arg;
+	struct wordIndex *wi = buf->words;
+	ssize_t n = 0;
+	while (wi->progress < buf->nrows){
+		erow *row = &buf->row[wi->progress];
+		ssize_t start = wi->rowpos;
+		ssize_t end = row->size - start > WORDS_STEP ? start + WORDS_STEP : row->size;
+		// One byte past the chunk tells whether it ends inside a word
+		const char *text = editorRowText(buf, row, start, end - start + (end < row->size), &scratch, &cap);
+		ssize_t skip = 0, stop = end - start;
+		if (wi->midword)
+			while (skip < stop && isIdentChar((unsigned char)text[skip])) skip++;
+		wi->midword = 0;
+		if (end < row->size && isIdentChar((unsigned char)text[stop - 1]) && isIdentChar((unsigned char)text[stop])){
+			// Leave a word crossing the boundary to the next chunk, unless
+			// it fills this one and so is far too long to index anyway
+			ssize_t k = stop;
+			while (k > skip && isIdentChar((unsigned char)text[k - 1])) k--;
+			if (k > skip) stop = k;
+			else wi->midword = 1;
+		}
+		wordIndexText(wi, text + skip, stop - skip, 1);
+		ssize_t j;
+		for (j = 0; j < stop; j++){
+			if (text[j] == '\t') wi->rowrpos += (TAB_STOP - 1) - (wi->rowrpos % TAB_STOP);
+			wi->rowrpos++;
+		}
+		wi->rowpos += stop;
+		if (wi->rowpos == row->size){
+			wi->progress++;
+			wi->rowpos = wi->rowrpos = 0;
+		}
+		n += stop + 1;
+		if (n >= WORDS_STEP){
+			n = 0;
+			if (schedExpired()) return 1;
+		}
+	}
+	return 0;
+}
+
+void wordsClear(struct wordIndex *wi){
+	size_t i;
+	for (i = 0; i < wi->cap; i++) free(wi->slots[i]);
+	free(wi->slots);
+	free(wi->sorted);
+	free(wi->fresh);
+	memset(wi, 0, sizeof(*wi));
+	wi->cap = 1024;
+	wi->slots = calloc(wi->cap, sizeof(struct wordEntry *));
+	if (wi->slots == NULL) bust("calloc");
+	wi->bytes = wi->cap * sizeof(struct wordEntry *);
+}
+
+// (Re)index the current buffer in the background
+void editorWordsStart(){
+	if (B->words == NULL){
+		B->words = calloc(1, sizeof(struct wordIndex));
+		if (B->words == NULL) bust("calloc");
+	}
+	wordsClear(B->words);
+	schedRemoveTask(wordsBuildStep, B);
+	schedAddTask(wordsBuildStep, B);
+}
+
+// Edit hook: rows not reached by the build yet are left to it
+void editorWordsRow(erow *row, int dir){
+	struct wordIndex *wi = B->words;
+	if (wi == NULL || row->render == NULL) return;
+	ssize_t at = row - B->row;
+	if (at == wi->progress && wi->rowpos){
+		// Partly indexed: take back what the build added, it starts over
+		if (dir < 0) wordIndexText(wi, row->render, wi->rowrpos, -1);
+		wi->rowpos = wi->rowrpos = 0;
+		wi->midword = 0;
+		return;
+	}
+	if (at >= wi->progress) return;
+	wordIndexText(wi, row->render, row->rsize, dir);
+}
+
+void editorWordsShift(ssize_t at, int dir){
+	struct wordIndex *wi = B->words;
+	if (wi == NULL) return;
+	// A row inserted above the partly indexed one pushes it down too
+	if (at < wi->progress || (at == wi->progress && wi->rowpos && dir > 0)) wi->progress += dir;
+}
+
 /*** row operations ***/
 
-int editorRowCxToRx(erow *row, int cx){
-	int rx = 0;
-	int j;
+ssize_t editorRowCxToRx(erow *row, ssize_t cx){
+	ssize_t rx = 0;
+	ssize_t j;
 	for (j = 0; j < cx; j++){
 		if (row->strings[j] == '\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP);
 		rx++;
 	}
 	return rx;
 }
-void editorRowInsertChar(erow *row, int at, int c){
+
+ssize_t editorRowRxToCx(erow *row, ssize_t rx){
+	ssize_t cur_rx = 0;
+	ssize_t cx;
+	for (cx = 0; cx < row->size; cx++){
+		if (row->strings[cx] == '\t') cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+		cur_rx++;
+		if (cur_rx > rx) return cx;
+	}
+	return cx;
+}
+
+void editorRowInsertChar(erow *row, ssize_t at, int c){
 	if (at < 0 || at > row->size) at = row->size;
-	row->strings = realloc(row->strings, row->size + 2);
+	row->strings = poolRealloc(row->strings, row->size + 2);
 	memmove(&row->strings[at + 1], &row->strings[at], row->size - at + 1);
 	row->size++;
 	row->strings[at] = c;
 	editorUpdateRow(row);
-	E.dirty++;
+	B->dirty++;
 }
 
-void editorRowDelChar(erow *row, int at){
+void editorRowDelChar(erow *row, ssize_t at){
 	if (at < 0 || at >= row->size) return;
 	memmove(&row->strings[at], &row->strings[at + 1], row->size - at);
 	row->size--;
 	editorUpdateRow(row);
-	E.dirty++;
+	B->dirty++;
 }
 
 void editorFreeRow(erow *row){
-	free(row->render);
-	free(row->strings);
+	poolFree(row->render);
+	poolFree(row->strings);
 }
 
-void editorDelRow(int at){
-	if (at < 0 || at >= E.nrows) return;
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at+1], sizeof(erow) * (E.nrows - at - 1));
-	E.nrows--;
-	E.dirty++;
+void editorDelRow(ssize_t at){
+	if (at < 0 || at >= B->nrows) return;
+	editorWordsRow(editorRow(at), -1);
+	editorWordsShift(at, -1);
+	if (B->wrapcols) B->wraptotal -= editorWrapLines(B->row[at].rsize);
+	editorFreeRow(&B->row[at]);
+	memmove(&B->row[at], &B->row[at+1], sizeof(erow) * (B->nrows - at - 1));
+	editorFilterRemove(at);
+	editorFilterShift(at + 1, -1);
+	editorSpillShift(at, -1);
+	B->nrows--;
+	editorWrapInvalidate(at);
+	B->dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len){
-	row->strings = realloc(row->strings, row->size + len + 1);
+	row->strings = poolRealloc(row->strings, row->size + len + 1);
 	memcpy(&row->strings[row->size], s, len);
 	row->size += len;
 	row->strings[row->size] = '\0';
 	editorUpdateRow(row);
-	E.dirty++;
-}
-void editorInsertRow(int at, char *s, size_t len){
-	if (at < 0 || at >= E.nrows) return;
-	E.row = realloc(E.row, sizeof(erow) * (E.nrows + 1));
-	memmove(&E.row[at+1], &E.row[at], sizeof(erow) * (E.nrows - at));
-	E.row[at].size = len;
-	E.row[at].strings = malloc(len+1);
-	memcpy(E.row[at].strings, s, len);
-	E.row[at].strings[len] = '\0';
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	editorUpdateRow(&E.row[at]);
-	E.nrows++;
-	E.dirty++;
+	B->dirty++;
+}
+//Grow the row table geometrically so loading n rows is O(n)
+void editorGrowRows(){
+	if (B->nrows < B->rowcap) return;
+	ssize_t cap = B->rowcap ? B->rowcap * 2 : 64;
+	erow *new = realloc(B->row, sizeof(erow) * cap);
+	if (new == NULL) bust("realloc");
+	B->row = new;
+	B->rowcap = cap;
+}
+
+// Replace every occurrence of from in row, returns the number replaced
+ssize_t editorRowReplaceAll(erow *row, const char *from, size_t flen, const char *to, size_t tlen){
+	if (flen == 0) return 0;
+	ssize_t count = 0;
+	char *p = row->strings;
+	char *end = row->strings + row->size;
+	while ((p = memmem(p, end - p, from, flen)) != NULL){
+		count++;
+		p += flen;
+	}
+	if (count == 0) return 0;
+	size_t newsize = row->size + count * (tlen - flen);
+	char *new = poolAlloc(newsize + 1);
+	char *q = new;
+	char *prev = row->strings;
+	while ((p = memmem(prev, end - prev, from, flen)) != NULL){
+		memcpy(q, prev, p - prev);
+		q += p - prev;
+		memcpy(q, to, tlen);
+		q += tlen;
+		prev = p + flen;
+	}
+	memcpy(q, prev, end - prev);
+	new[newsize] = '\0';
+	poolFree(row->strings);
+	row->strings = new;
+	row->size = newsize;
+	editorUpdateRow(row);
+	B->dirty++;
+	return count;
+}
+
+void editorInsertRow(ssize_t at, char *s, size_t len){
+	if (at < 0 || at > B->nrows) return;
+	editorGrowRows();
+	memmove(&B->row[at+1], &B->row[at], sizeof(erow) * (B->nrows - at));
+	editorFilterShift(at, 1);
+	editorWordsShift(at, 1);
+	editorSpillShift(at, 1);
+	B->row[at].size = len;
+	B->row[at].strings = poolAlloc(len+1);
+	memcpy(B->row[at].strings, s, len);
+	B->row[at].strings[len] = '\0';
+	B->row[at].rsize = 0;
+	B->row[at].render = NULL;
+	B->row[at].store = -1;
+	B->wraptotal++; //as an empty row, editorUpdateRow adds the rest
+	editorWrapInvalidate(at);
+	editorUpdateRow(&B->row[at]);
+	B->nrows++;
+	// Rows typed into a filtered view stay in it
+	if (B->filter) editorFilterAdd(at);
+	B->dirty++;
 }
 
 /*** editor operations ***/
 
 void editorInsertChar(int c){
-	if (E.cy == E.nrows) editorInsertRow(E.nrows, "", 0);
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+	if (B->cy == B->nrows) editorInsertRow(B->nrows, "", 0);
+	editorRowInsertChar(editorRow(B->cy), B->cx, c);
+	B->cx++;
 }
 void editorInsertNewLine(){
-	if (E.cx == 0){
-		editorInsertRow(E.cy, "", 0);
+	if (B->cx == 0){
+		editorInsertRow(B->cy, "", 0);
 	} else {
-		erow *row = &E.row[E.cy];
-		editorInsertRow(E.cy+1, &row->strings[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
+		erow *row = editorRow(B->cy);
+		editorInsertRow(B->cy+1, &row->strings[B->cx], row->size - B->cx);
+		row = &B->row[B->cy];
+		row->size = B->cx;
 		row->strings[row->size] = '\0';
 		editorUpdateRow(row);
 	}
-	E.cy++;
-	E.cx = 0;
+	B->cy++;
+	B->cx = 0;
+}
+
+void editorDelChar(){
+	if (B->cy == B->nrows) return;
+	if (B->cx == 0 && B->cy == 0) return;
+	if (B->cx == 0 && B->filter){
+		// The row above may be hidden by the filter
+		editorSetStatusMessage("Can't join lines in a filtered view");
+		return;
+	}
+
+	erow *row = editorRow(B->cy);
+
+	if (B->cx > 0){
+		editorRowDelChar(row, B->cx-1);
+		B->cx--;
+	} else {
+		B->cx = B->row[B->cy - 1].size;
+		editorRowAppendString(editorRow(B->cy - 1), row->strings, row->size);
+		editorDelRow(B->cy);
+		B->cy--;
+	}
+}
+
+/*** completion ***/
+
+int completeCmp(const void *a, const void *b){
+	const struct wordEntry *x = *(const struct wordEntry **)a;
+	const struct wordEntry *y = *(const struct wordEntry **)b;
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+	return strcmp(x->word, y->word);
+}
+
+// Restore the heap below i, worst candidate on top
+void completeSiftDown(struct wordEntry **h, int n, int i){
+	while (1){
+		int m = i, l = 2 * i + 1, r = l + 1;
+		if (l < n && completeCmp(&h[l], &h[m]) > 0) m = l;
+		if (r < n && completeCmp(&h[r], &h[m]) > 0) m = r;
+		if (m == i) return;
+		struct wordEntry *t = h[i];
+		h[i] = h[m];
+		h[m] = t;
+		i = m;
+	}
+}
+
+void completeReset(){
+	struct completion *cs = &E.complete;
+	int i;
+	for (i = 0; i < cs->ncands; i++) free(cs->cands[i]);
+	cs->ncands = 0;
+	cs->buf = NULL;
+}
+
+// Words starting with prefix are one run of a sorted array, found by
+// binary search; the heap keeps the COMPLETE_MAX most used, worst on top
+void completeScan(struct wordEntry **v, size_t nv, const char *prefix, size_t len,
+		struct wordEntry **found, int *n){
+	size_t lo = 0, hi = nv;
+	while (lo < hi){
+		size_t mid = (lo + hi) / 2;
+		if (strncmp(v[mid]->word, prefix, len) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < nv && strncmp(v[lo]->word, prefix, len) == 0; lo++){
+		struct wordEntry *e = v[lo];
+		if (e->count == 0 || e->len <= len) continue;
+		if (*n < COMPLETE_MAX){
+			int j = (*n)++;
+			found[j] = e;
+			while (j > 0 && completeCmp(&found[(j - 1) / 2], &found[j]) < 0){
+				found[j] = found[(j - 1) / 2];
+				found[(j - 1) / 2] = e;
+				j = (j - 1) / 2;
+			}
+		} else if (completeCmp(&e, &found[0]) < 0){
+			found[0] = e;
+			completeSiftDown(found, *n, 0);
+		}
+	}
+}
+
+void completeFind(struct wordIndex *wi, const char *prefix, size_t len){
+	struct completion *cs = &E.complete;
+	struct wordEntry *found[COMPLETE_MAX];
+	int i, n = 0;
+	wordMerge(wi, 0);
+	completeScan(wi->sorted, wi->nsorted, prefix, len, found, &n);
+	completeScan(wi->fresh, wi->nfresh, prefix, len, found, &n);
+	qsort(found, n, sizeof(found[0]), completeCmp);
+	for (i = 0; i < n; i++) cs->cands[i] = strdup(found[i]->word);
+	cs->ncands = n;
+	cs->next = 0;
+}
+
+// Ctrl-N: complete the identifier before the cursor, again to cycle
+void editorComplete(){
+	struct completion *cs = &E.complete;
+	if (B->cy >= B->nrows) return;
+	if (B->words == NULL){
+		editorWordsStart();
+		editorSetStatusMessage("Indexing words, try again in a moment");
+		return;
+	}
+	erow *row = editorRow(B->cy);
+	int again = cs->buf == B && cs->cy == B->cy && cs->dirty == B->dirty
+		&& B->cx == cs->start + (ssize_t)(cs->prefixlen + cs->insertedlen);
+	if (!again){
+		completeReset();
+		ssize_t start = B->cx;
+		while (start > 0 && isIdentChar((unsigned char)row->strings[start - 1])) start--;
+		if (start == B->cx) return;
+		cs->buf = B;
+		cs->cy = B->cy;
+		cs->start = start;
+		cs->prefixlen = B->cx - start;
+		cs->insertedlen = 0;
+		completeFind(B->words, &row->strings[start], cs->prefixlen);
+	}
+
+	// Take back the last candidate, then insert the next one; after the
+	// last candidate the bare prefix comes round again
+	ssize_t at = cs->start + cs->prefixlen;
+	while (cs->insertedlen){
+		editorRowDelChar(row, at);
+		cs->insertedlen--;
+	}
+	const char *word = cs->next < cs->ncands ? cs->cands[cs->next] : NULL;
+	size_t i;
+	if (word){
+		for (i = cs->prefixlen; word[i]; i++) editorRowInsertChar(row, at++, word[i]);
+		cs->insertedlen = strlen(word) - cs->prefixlen;
+	}
+	B->cx = cs->start + cs->prefixlen + cs->insertedlen;
+	cs->dirty = B->dirty;
+	if (cs->ncands) cs->next = (cs->next + 1) % (cs->ncands + 1);
+
+	struct wordIndex *wi = B->words;
+	int building = wi->progress < B->nrows;
+	if (cs->ncands == 0)
+		editorSetStatusMessage("No completion%s | %zu words, %zu KB%s", building ? " yet" : "",
+				wi->nwords, wi->bytes / 1024, building ? " (indexing)" : "");
+	else
+		editorSetStatusMessage("Match %d/%d | %zu words, %zu KB%s%s", word ? cs->next : cs->ncands + 1,
+				cs->ncands + 1, wi->nwords, wi->bytes / 1024, building ? " (indexing)" : "", wi->full ? " (full)" : "");
+}
+
+/*** row commands ***/
+
+// Rows are sorted as pointers and gathered once, text never moves
+struct sortItem{
+	double key; //numeric sort only
+	erow *row;
+};
+
+struct sortJob{
+	struct sortItem *src, *dst;
+	size_t lo, mid, hi;
+	int numeric;
+};
+
+int sortCmpLex(const void *a, const void *b){
+	const erow *x = ((const struct sortItem *)a)->row;
+	const erow *y = ((const struct sortItem *)b)->row;
+	ssize_t n = x->size < y->size ? x->size : y->size;
+	int c = memcmp(x->strings, y->strings, n);
+	if (c) return c;
+	return (x->size > y->size) - (x->size < y->size);
+}
+
+// Key as sort -n reads it: blanks, an optional minus, digits and an
+// optional fraction; anything else is 0, so there is no nan, inf or hex
+// and the comparison stays a total order
+double sortNumKey(const char *s){
+	while (*s == ' ' || *s == '\t') s++;
+	int neg = *s == '-';
+	if (neg) s++;
+	double v = 0;
+	for (; isdigit((unsigned char)*s); s++) v = v * 10 + (*s - '0');
+	if (*s == '.'){
+		double scale = 1;
+		for (s++; isdigit((unsigned char)*s); s++){
+			scale /= 10;
+			v += (*s - '0') * scale;
+		}
+	}
+	return neg ? -v : v;
+}
+
+int sortCmpNum(const void *a, const void *b){
+	double x = ((const struct sortItem *)a)->key;
+	double y = ((const struct sortItem *)b)->key;
+	if (x != y) return x < y ? -1 : 1;
+	return sortCmpLex(a, b);
+}
+
+void sortChunk(void *arg){
+	struct sortJob *job = arg;
+	size_t i;
+	if (job->numeric)
+		for (i = job->lo; i < job->hi; i++) job->src[i].key = sortNumKey(job->src[i].row->strings);
+	qsort(&job->src[job->lo], job->hi - job->lo, sizeof(struct sortItem), job->numeric ? sortCmpNum : sortCmpLex);
+}
+
+void sortMerge(void *arg){
+	struct sortJob *job = arg;
+	int (*cmp)(const void *, const void *) = job->numeric ? sortCmpNum : sortCmpLex;
+	size_t i = job->lo, j = job->mid, k = job->lo;
+	while (i < job->mid && j < job->hi)
+		job->dst[k++] = cmp(&job->src[j], &job->src[i]) < 0 ? job->src[j++] : job->src[i++];
+	while (i < job->mid) job->dst[k++] = job->src[i++];
+	while (j < job->hi) job->dst[k++] = job->src[j++];
+}
+
+// Sort chunks on every core, then merge pairs of runs level by level
+void editorSortItems(struct sortItem *items, size_t n, int numeric){
+	int nthreads = tpoolDefaultThreads();
+	size_t nchunks = n < SORT_PAR_MIN ? 1 : (size_t)nthreads;
+	if (nchunks > n / (SORT_PAR_MIN / 4) + 1) nchunks = n / (SORT_PAR_MIN / 4) + 1;
+	struct sortJob single = {items, NULL, 0, 0, n, numeric};
+	if (nchunks <= 1){
+		sortChunk(&single);
+		return;
+	}
+
+	struct sortItem *tmp = malloc(sizeof(struct sortItem) * n);
+	size_t *bounds = malloc(sizeof(size_t) * (nchunks + 1));
+	struct sortJob *jobs = malloc(sizeof(struct sortJob) * nchunks);
+	if (tmp == NULL || bounds == NULL || jobs == NULL) bust("malloc");
+	struct tpool *pool = tpoolShared();
+	struct tpoolGroup group = {0};
+	size_t i;
+	for (i = 0; i <= nchunks; i++) bounds[i] = n * i / nchunks;
+	for (i = 0; i < nchunks; i++){
+		jobs[i] = single;
+		jobs[i].lo = bounds[i];
+		jobs[i].hi = bounds[i + 1];
+		tpoolSubmitGroup(pool, &group, sortChunk, &jobs[i]);
+	}
+	tpoolWaitGroup(pool, &group);
+
+	struct sortItem *src = items, *dst = tmp;
+	while (nchunks > 1){
+		size_t runs = 0;
+		for (i = 0; i + 1 < nchunks; i += 2){
+			jobs[runs].src = src;
+			jobs[runs].dst = dst;
+			jobs[runs].lo = bounds[i];
+			jobs[runs].mid = bounds[i + 1];
+			jobs[runs].hi = bounds[i + 2];
+			jobs[runs].numeric = numeric;
+			tpoolSubmitGroup(pool, &group, sortMerge, &jobs[runs]);
+			bounds[runs++] = bounds[i];
+		}
+		if (i < nchunks){
+			memcpy(&dst[bounds[i]], &src[bounds[i]], sizeof(struct sortItem) * (bounds[i + 1] - bounds[i]));
+			bounds[runs++] = bounds[i];
+		}
+		bounds[runs] = n;
+		nchunks = runs;
+		tpoolWaitGroup(pool, &group);
+		struct sortItem *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != items) memcpy(items, src, sizeof(struct sortItem) * n);
+	free(jobs);
+	free(bounds);
+	free(tmp);
+}
+
+void editorRowUndoDiscard(){
+	struct rowUndo *u = B->undo;
+	if (u == NULL) return;
+	ssize_t i;
+	for (i = 0; i < u->nremoved; i++) editorFreeRow(&u->removed[i]);
+	free(u->removed);
+	free(u->saved);
+	free(u);
+	B->undo = NULL;
+}
+
+// Snapshot the range so the command can be undone as one step
+struct rowUndo *editorRowUndoBegin(ssize_t at, ssize_t len){
+	editorRowUndoDiscard();
+	struct rowUndo *u = calloc(1, sizeof(*u));
+	if (u == NULL) bust("calloc");
+	u->saved = malloc(sizeof(erow) * (len ? len : 1));
+	if (u->saved == NULL) bust("malloc");
+	memcpy(u->saved, &B->row[at], sizeof(erow) * len);
+	u->at = at;
+	u->oldlen = u->newlen = len;
+	B->undo = u;
+	return u;
+}
+
+void editorRowCommandDone(struct rowUndo *u){
+	B->wrapcols = 0;
+	editorSpillReset();
+	B->dirty++;
+	u->dirty = B->dirty;
+	if (B->cy > B->nrows) B->cy = B->nrows;
+	B->cx = 0;
+	editorFilterRefresh();
+	if (B->words) editorWordsStart();
+}
+
+void editorSortRows(ssize_t at, ssize_t len, int numeric){
+	editorFaultRows(at, len);
+	struct rowUndo *u = editorRowUndoBegin(at, len);
+	struct sortItem *items = malloc(sizeof(struct sortItem) * (len ? len : 1));
+	if (items == NULL) bust("malloc");
+	ssize_t i;
+	for (i = 0; i < len; i++) items[i].row = &u->saved[i];
+	editorSortItems(items, len, numeric);
+	for (i = 0; i < len; i++) B->row[at + i] = *items[i].row;
+	free(items);
+	editorRowCommandDone(u);
+}
+
+// Drop adjacent duplicates, as uniq(1) does
+void editorUniqRows(ssize_t at, ssize_t len){
+	editorFaultRows(at, len);
+	struct rowUndo *u = editorRowUndoBegin(at, len);
+	u->removed = malloc(sizeof(erow) * (len ? len : 1));
+	if (u->removed == NULL) bust("malloc");
+	ssize_t i, kept = 0;
+	for (i = 0; i < len; i++){
+		erow *row = &u->saved[i];
+		erow *last = kept ? &B->row[at + kept - 1] : NULL;
+		if (last && last->size == row->size && memcmp(last->strings, row->strings, row->size) == 0)
+			u->removed[u->nremoved++] = *row;
+		else
+			B->row[at + kept++] = *row;
+	}
+	memmove(&B->row[at + kept], &B->row[at + len], sizeof(erow) * (B->nrows - at - len));
+	B->nrows -= len - kept;
+	u->newlen = kept;
+	editorRowCommandDone(u);
 }
 
-void editorDelChar(){
-	if (E.cy == E.nrows) return;
-	if (E.cx == 0 && E.cy == 0) return;
+void editorReverseRows(ssize_t at, ssize_t len){
+	struct rowUndo *u = editorRowUndoBegin(at, len);
+	ssize_t i;
+	for (i = 0; i < len; i++) B->row[at + i] = u->saved[len - 1 - i];
+	editorRowCommandDone(u);
+}
 
-	erow *row = &E.row[E.cy];
+void editorRowUndo(){
+	struct rowUndo *u = B->undo;
+	if (u == NULL || u->dirty != B->dirty){
+		editorRowUndoDiscard();
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+	// uniq never shrinks the table, so the old rows still fit
+	ssize_t grow = u->oldlen - u->newlen;
+	memmove(&B->row[u->at + u->oldlen], &B->row[u->at + u->newlen], sizeof(erow) * (B->nrows - u->at - u->newlen));
+	memcpy(&B->row[u->at], u->saved, sizeof(erow) * u->oldlen);
+	B->nrows += grow;
+	// The dropped rows are live again, only the bookkeeping goes
+	u->nremoved = 0;
+	editorRowUndoDiscard();
+	B->wrapcols = 0;
+	editorSpillReset();
+	B->dirty++;
+	editorFilterRefresh();
+	if (B->words) editorWordsStart();
+	editorSetStatusMessage("Undone");
+}
 
-	if (E.cx > 0){
-		editorRowDelChar(row, E.cx-1);
-		E.cx--;
+// Ctrl-X: sort [-n], uniq or reverse over [from to] (default all lines)
+void editorRowCommand(){
+	char *cmd = editorPrompt("Command (sort [-n] | uniq | reverse) [from to]: %s");
+	if (cmd == NULL) return;
+	char *name = strtok(cmd, " ");
+	char *tok;
+	if (name == NULL){
+		free(cmd);
+		return;
+	}
+	int numeric = 0;
+	ssize_t nums[2];
+	int nnums = 0;
+	while ((tok = strtok(NULL, " ")) != NULL){
+		if (strcmp(tok, "-n") == 0) numeric = 1;
+		else if (nnums < 2) nums[nnums++] = strtol(tok, NULL, 10);
+	}
+	ssize_t from = nnums >= 1 ? nums[0] : 1;
+	ssize_t to = nnums >= 2 ? nums[1] : B->nrows;
+	if (nnums == 1 || from < 1 || to > B->nrows || from > to){
+		editorSetStatusMessage("Bad line range");
+	} else if (strcmp(name, "sort") == 0){
+		editorSortRows(from - 1, to - from + 1, numeric);
+		editorSetStatusMessage("Sorted %zd lines (Ctrl-Z to undo)", to - from + 1);
+	} else if (strcmp(name, "uniq") == 0){
+		editorUniqRows(from - 1, to - from + 1);
+		editorSetStatusMessage("Removed %zd duplicate lines (Ctrl-Z to undo)", B->undo->nremoved);
+	} else if (strcmp(name, "reverse") == 0){
+		editorReverseRows(from - 1, to - from + 1);
+		editorSetStatusMessage("Reversed %zd lines (Ctrl-Z to undo)", to - from + 1);
 	} else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->strings, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+		editorSetStatusMessage("Unknown command: %s", name);
 	}
+	free(cmd);
 }
 
 /*** append buffer ***/
 
 struct abuf{
 	char *b;
-	int len;
+	size_t len;
 };
 
 #define ABUF_INIT {NULL, 0}
 
-void abAppend(struct abuf* ab, const char *s, int len){
+void abAppend(struct abuf* ab, const char *s, size_t len){
 	char *new = realloc(ab->b, ab->len + len);
 	if (new == NULL) return;
 	memcpy(&new[ab->len], s, len);
@@ -304,36 +2056,288 @@ void abFree(struct abuf *ab){
 	free(ab->b);
 }
 
+/*** hex view ***/
+
+// Files with a NUL in their first block are mapped instead of split into rows
+int editorOpenHex(char *filename){
+	int ro = 0;
+	int fd = open(filename, O_RDWR);
+	if (fd == -1){
+		fd = open(filename, O_RDONLY);
+		ro = 1;
+	}
+	if (fd == -1) return -1;
+	struct stat st;
+	unsigned char head[4096];
+	ssize_t n;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0
+			|| (n = pread(fd, head, sizeof(head), 0)) <= 0 || memchr(head, '\0', n) == NULL){
+		close(fd);
+		return -1;
+	}
+	// Shared so bytes written back with pwrite show up in the map
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED){
+		close(fd);
+		return -1;
+	}
+	B->hex = 1;
+	B->hexfd = fd;
+	B->hexro = ro;
+	B->hexmap = map;
+	B->hexsize = st.st_size;
+	B->hexcur = 0;
+	B->hextop = 0;
+	B->hexnibble = 0;
+	B->dirty = 0;
+	return 0;
+}
+
+ssize_t editorHexFindPatch(size_t off){
+	size_t lo = 0, hi = B->npatches;
+	while (lo < hi){
+		size_t mid = (lo + hi) / 2;
+		if (B->patches[mid].off < off) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+unsigned char editorHexByte(size_t off){
+	size_t i = editorHexFindPatch(off);
+	if (i < B->npatches && B->patches[i].off == off) return B->patches[i].byte;
+	return B->hexmap[off];
+}
+
+void editorHexPatch(size_t off, unsigned char byte){
+	size_t i = editorHexFindPatch(off);
+	if (i < B->npatches && B->patches[i].off == off){
+		B->patches[i].byte = byte;
+		return;
+	}
+	if (B->npatches == B->patchcap){
+		B->patchcap = B->patchcap ? B->patchcap * 2 : 64;
+		B->patches = realloc(B->patches, sizeof(struct hexPatch) * B->patchcap);
+		if (B->patches == NULL) bust("realloc");
+	}
+	memmove(&B->patches[i + 1], &B->patches[i], sizeof(struct hexPatch) * (B->npatches - i));
+	B->patches[i].off = off;
+	B->patches[i].byte = byte;
+	B->npatches++;
+	B->dirty++;
+}
+
+// Write patched bytes in place, one pwrite per run of adjacent offsets
+void editorHexSave(){
+	unsigned char run[4096];
+	size_t i = 0;
+	while (i < B->npatches){
+		size_t start = B->patches[i].off;
+		size_t n = 0;
+		while (i < B->npatches && n < sizeof(run) && B->patches[i].off == start + n)
+			run[n++] = B->patches[i++].byte;
+		if (pwrite(B->hexfd, run, n, start) != (ssize_t)n){
+			editorSetStatusMessage("Can't write to file I/O error: %s", strerror(errno));
+			return;
+		}
+	}
+	editorSetStatusMessage("%zu bytes patched", B->npatches);
+	B->npatches = 0;
+	B->dirty = 0;
+}
+
+int editorHexOffsetWidth(){
+	int w = 8;
+	while (w < 16 && (B->hexsize - 1) >> (w * 4)) w++;
+	return w;
+}
+
+// Only the lines on screen are formatted, straight from the mapping
+void editorDrawHexRows(struct abuf *ab){
+	int w = editorHexOffsetWidth();
+	int y;
+	for (y = 0; y < E.screenrows; y++){
+		size_t off = B->hextop + (size_t)y * HEX_LINE;
+		if (off >= B->hexsize){
+			abAppend(ab, "~", 1);
+		} else {
+			char line[128];
+			char ascii[HEX_LINE + 1];
+			int len = snprintf(line, sizeof(line), "%0*zx ", w, off);
+			int i;
+			for (i = 0; i < HEX_LINE; i++){
+				if (i == HEX_LINE / 2) line[len++] = ' ';
+				if (off + i < B->hexsize){
+					unsigned char c = editorHexByte(off + i);
+					len += snprintf(&line[len], sizeof(line) - len, " %02x", c);
+					ascii[i] = isprint(c) ? c : '.';
+				} else {
+					len += snprintf(&line[len], sizeof(line) - len, "   ");
+					ascii[i] = ' ';
+				}
+			}
+			ascii[HEX_LINE] = '\0';
+			len += snprintf(&line[len], sizeof(line) - len, "  |%s|", ascii);
+			if (len > E.screencols) len = E.screencols;
+			abAppend(ab, line, len);
+		}
+		abAppend(ab, "\x1b[K", 3);
+		abAppend(ab, "\r\n", 2);
+	}
+}
+
+void editorHexScroll(){
+	size_t line = B->hexcur / HEX_LINE * HEX_LINE;
+	size_t page = (size_t)E.screenrows * HEX_LINE;
+	if (line < B->hextop) B->hextop = line;
+	if (line >= B->hextop + page) B->hextop = line - page + HEX_LINE;
+}
+
+void editorHexCursor(int *y, int *x){
+	size_t col = B->hexcur % HEX_LINE;
+	*y = (B->hexcur - B->hextop) / HEX_LINE;
+	*x = editorHexOffsetWidth() + 2 + col * 3 + (col >= HEX_LINE / 2) + B->hexnibble;
+}
+
+void editorHexMove(ssize_t delta){
+	B->hexnibble = 0;
+	if (delta < 0 && (size_t)-delta > B->hexcur) B->hexcur = 0;
+	else B->hexcur += delta;
+	if (B->hexcur >= B->hexsize) B->hexcur = B->hexsize - 1;
+}
+
+// Returns 0 for keys the normal editor should still handle (quit, buffers, save)
+int editorHexProcessKey(int c){
+	ssize_t page = (ssize_t)E.screenrows * HEX_LINE;
+	switch (c){
+		case CTRL_KEY('q'):
+		case CTRL_KEY('b'):
+		case CTRL_KEY('s'):
+			return 0;
+		case ARROW_LEFT: editorHexMove(-1); break;
+		case ARROW_RIGHT: editorHexMove(1); break;
+		case ARROW_UP: editorHexMove(-HEX_LINE); break;
+		case ARROW_DOWN: editorHexMove(HEX_LINE); break;
+		case PAGE_UP: editorHexMove(-page); break;
+		case PAGE_DOWN: editorHexMove(page); break;
+		case HOME_KEY: editorHexMove(-(ssize_t)(B->hexcur % HEX_LINE)); break;
+		case END_KEY: editorHexMove(HEX_LINE - 1 - B->hexcur % HEX_LINE); break;
+		case CTRL_KEY('g'):
+			{
+				char *q = editorPrompt("Go to offset (0x hex or decimal): %s");
+				if (q == NULL) break;
+				char *end;
+				errno = 0;
+				unsigned long long off = strtoull(q, &end, 0);
+				if (errno || *end || off >= B->hexsize)
+					editorSetStatusMessage("Bad offset: %s", q);
+				else {
+					B->hexcur = off;
+					B->hexnibble = 0;
+				}
+				free(q);
+			}
+			break;
+		default:
+			if (c >= 0 && c < 128 && isxdigit(c)){
+				if (B->hexro){
+					editorSetStatusMessage("File is read-only");
+					break;
+				}
+				int d = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+				unsigned char v = editorHexByte(B->hexcur);
+				if (!B->hexnibble){
+					editorHexPatch(B->hexcur, (d << 4) | (v & 0x0f));
+					B->hexnibble = 1;
+				} else {
+					editorHexPatch(B->hexcur, (v & 0xf0) | d);
+					editorHexMove(1);
+				}
+			}
+			break;
+	}
+	return 1;
+}
+
 /*** input ***/
 
+char *editorPrompt(char *prompt){
+	size_t bufsize = 128;
+	char *buf = malloc(bufsize);
+	size_t buflen = 0;
+	buf[0] = '\0';
+	while (1){
+		editorSetStatusMessage(prompt, buf);
+		editorRefreshScreen();
+		int c = editorReadKey();
+		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE){
+			if (buflen != 0) buf[--buflen] = '\0';
+		} else if (c == '\x1b'){
+			editorSetStatusMessage("");
+			free(buf);
+			return NULL;
+		} else if (c == '\r'){
+			if (buflen != 0){
+				editorSetStatusMessage("");
+				return buf;
+			}
+		} else if (!iscntrl(c) && c < 128){
+			if (buflen == bufsize - 1){
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+			buf[buflen++] = c;
+			buf[buflen] = '\0';
+		}
+	}
+}
+
+// Soft wrap: move the cursor n screen lines, keeping its screen column
+void editorWrapMoveLines(ssize_t n){
+	ssize_t x, sub;
+	editorScroll();
+	ssize_t target = editorWrapCursor(&x) + n;
+	if (target < 0) target = 0;
+	if (target > B->wraptotal) target = B->wraptotal;
+	B->cy = editorWrapFind(target, &sub);
+	if (B->cy >= B->nrows){
+		B->cx = 0;
+		return;
+	}
+	B->cx = editorRowRxToCx(editorRow(B->cy), sub * E.screencols + x);
+}
+
 void editorMoveCursor(int key){
-	erow *row = (E.cy >= E.nrows) ? NULL : &E.row[E.cy];
+	erow *row = (B->cy >= B->nrows) ? NULL : &B->row[B->cy];
 	switch(key){
 		case ARROW_LEFT:
-			if (E.cx != 0) E.cx--;
-			else if  (E.cy > 0){
-				E.cy--;
-				E.cx = E.row[E.cy].size;
+			if (B->cx != 0) B->cx--;
+			else if  (B->cy > 0 && editorRowToView(B->cy) > 0){
+				B->cy = editorViewStep(B->cy, -1);
+				B->cx = B->row[B->cy].size;
 			}
 			break;
 		case ARROW_UP:
-			if (E.cy != 0) E.cy--;
-			break;
 		case ARROW_DOWN:
-			if (E.cy < E.nrows) E.cy++;
+			if (B->softwrap){
+				editorWrapMoveLines(key == ARROW_UP ? -1 : 1);
+				break;
+			}
+			if (key == ARROW_UP && B->cy != 0) B->cy = editorViewStep(B->cy, -1);
+			if (key == ARROW_DOWN && B->cy < B->nrows) B->cy = editorViewStep(B->cy, 1);
 			break;
 		case ARROW_RIGHT:
-			if (row && (E.cx < row->size)) E.cx++;
-			else if (row && E.cx == row->size){
-				E.cy++;
-				E.cx = 0;
+			if (row && (B->cx < row->size)) B->cx++;
+			else if (row && B->cx == row->size){
+				B->cy = editorViewStep(B->cy, 1);
+				B->cx = 0;
 			}
 			break;
 	}
-	row = (E.cy >= E.nrows) ? NULL : &E.row[E.cy];
-	int rowlen = row ? row->size : 0;
-	if (E.cx > rowlen){
-		E.cx = rowlen;
+	row = (B->cy >= B->nrows) ? NULL : &B->row[B->cy];
+	ssize_t rowlen = row ? row->size : 0;
+	if (B->cx > rowlen){
+		B->cx = rowlen;
 	}
 	
 }
@@ -341,25 +2345,31 @@ void editorMoveCursor(int key){
 void editorProcessKeypress(){
 	static int quit_times = QUIT_TIMES;
 	int c = editorReadKey();
+	if (B->hex && editorHexProcessKey(c)){
+		quit_times = QUIT_TIMES;
+		return;
+	}
 	switch(c){
 		case '\r': 
 			editorInsertNewLine();
 			break;
 		case CTRL_KEY('q'):
-			if (E.dirty && quit_times > 0){
+			if (editorAnyDirty() && quit_times > 0){
 				editorSetStatusMessage("WARNING!!! File has unsaved changes. "
 						"Press Ctrl-Q %d more times to quit.", quit_times);
 				quit_times--;
 				return;
 			}
+			// Let a sidecar being written finish rather than leave a temp file
+			schedWaitJobs();
 			exit(0);
 			break;
 		//HOME END KEY
 		case HOME_KEY:
-			E.cx = 0;
+			B->cx = 0;
 			break;
 		case END_KEY:
-			if (E.cy < E.nrows) E.cx = E.row[E.cy].size;
+			if (B->cy < B->nrows) B->cx = B->row[B->cy].size;
 			break;
 
 		case BACKSPACE:
@@ -371,12 +2381,23 @@ void editorProcessKeypress(){
 		// PAGE UP DOWN
 		case PAGE_UP:
 		case PAGE_DOWN:
-			{
+			if (B->softwrap){
+				// Jump through the wrap index instead of stepping line by line
+				ssize_t x;
+				editorScroll();
+				ssize_t cur = editorWrapCursor(&x);
+				if (c == PAGE_UP)
+					editorWrapMoveLines(B->vrowoff - cur - E.screenrows);
+				else
+					editorWrapMoveLines(B->vrowoff + 2 * E.screenrows - 1 - cur);
+			} else {
+				// rowoff counts view rows, which are file rows without a filter
 				if (c == PAGE_UP){
-					E.cy = E.rowoff;
+					B->cy = editorViewToRow(B->rowoff);
 				} else if (c == PAGE_DOWN) {
-					E.cy = E.rowoff + E.screenrows - 1;
-					if (E.cy > E.nrows) E.cy = E.nrows;
+					ssize_t v = B->rowoff + E.screenrows - 1;
+					if (v > editorViewRows()) v = editorViewRows();
+					B->cy = editorViewToRow(v);
 				}
 				int times = E.screenrows;
 				while (times--)
@@ -393,6 +2414,31 @@ void editorProcessKeypress(){
 		case CTRL_KEY('l'):
 		case '\x1b':
 			break;
+
+		case CTRL_KEY('w'):
+			editorToggleSoftWrap();
+			break;
+
+		case CTRL_KEY('x'):
+			editorRowCommand();
+			break;
+
+		case CTRL_KEY('z'):
+			editorRowUndo();
+			break;
+
+		case CTRL_KEY('f'):
+			editorFilter();
+			break;
+
+		case CTRL_KEY('n'):
+			editorComplete();
+			break;
+
+		case CTRL_KEY('b'):
+			if (editorSwitchBuffer(E.curbuf + 1) == 0)
+				editorSetStatusMessage("Buffer %d/%d: %s", E.curbuf + 1, E.nbufs, B->filename ? B->filename : "[No Name]");
+			break;
 		
 		case CTRL_KEY('s'):
 			editorSave();
@@ -407,32 +2453,76 @@ void editorProcessKeypress(){
 /*** output ***/
 
 void editorScroll(){
+	if (B->hex){
+		editorHexScroll();
+		return;
+	}
 	// Cursor goes past upper limit, back off by 1 line
-	E.rx = 0;
-	if (E.cy < E.nrows){
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+	B->rx = 0;
+	if (B->cy < B->nrows){
+		B->rx = editorRowCxToRx(editorRow(B->cy), B->cx);
+	}
+	if (B->softwrap){
+		ssize_t x;
+		ssize_t cur = editorWrapCursor(&x);
+		if (cur < B->vrowoff) B->vrowoff = cur;
+		if (cur >= B->vrowoff + E.screenrows) B->vrowoff = cur - E.screenrows + 1;
+		return;
 	}
-	if (E.cy < E.rowoff){
-		E.rowoff = E.cy;
+	ssize_t vcy = editorRowToView(B->cy);
+	if (vcy < B->rowoff){
+		B->rowoff = vcy;
 	}
 	// Cursor goes past bottom limit, scroww more by 1 line
-	if (E.cy >= E.rowoff + E.screenrows){
-		E.rowoff = E.cy - E.screenrows + 1;
+	if (vcy >= B->rowoff + E.screenrows){
+		B->rowoff = vcy - E.screenrows + 1;
 	}
-	if (E.rx < E.coloff){
-		E.coloff = E.rx;
+	if (B->rx < B->coloff){
+		B->coloff = B->rx;
 	}
-	if (E.rx >= E.coloff + E.screencols){
-		E.coloff = E.rx - E.screencols+ 1;
+	if (B->rx >= B->coloff + E.screencols){
+		B->coloff = B->rx - E.screencols+ 1;
+	}
+}
+
+void editorDrawWrappedRows(struct abuf *ab){
+	ssize_t sub;
+	ssize_t filerow = editorWrapFind(B->vrowoff, &sub);
+	int y;
+	for (y = 0; y < E.screenrows; y++){
+		if (filerow >= B->nrows){
+			abAppend(ab, "~", 1);
+		} else {
+			erow *row = editorRow(filerow);
+			ssize_t start = sub * E.screencols;
+			ssize_t len = row->rsize - start;
+			if (len < 0) len = 0;
+			if (len > E.screencols) len = E.screencols;
+			abAppend(ab, &row->render[start], len);
+			if (++sub >= editorWrapLines(row->rsize)){
+				filerow++;
+				sub = 0;
+			}
+		}
+		abAppend(ab, "\x1b[K", 3);
+		abAppend(ab, "\r\n", 2);
 	}
 }
 
 void editorDrawRows(struct abuf *ab){
+	if (B->hex){
+		editorDrawHexRows(ab);
+		return;
+	}
+	if (B->softwrap && B->nrows){
+		editorDrawWrappedRows(ab);
+		return;
+	}
 	int y;
 	for (y = 0; y < E.screenrows; y++){
-		int filerow = y + E.rowoff;
-		if (filerow  >= E.nrows){
-		if (E.nrows == 0 && y == E.screenrows / 3){
+		ssize_t filerow = editorViewToRow(y + B->rowoff);
+		if (filerow  >= B->nrows){
+		if (B->nrows == 0 && y == E.screenrows / 3){
 			char welcome[80];
 			int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
 			if (welcomelen > E.screencols) welcomelen = E.screencols;
@@ -447,10 +2537,11 @@ void editorDrawRows(struct abuf *ab){
 			abAppend(ab, "~", 1);
 		}
 		} else {
-			int len = E.row[filerow].rsize - E.coloff;
+			erow *row = editorRow(filerow);
+			ssize_t len = row->rsize - B->coloff;
 			if (len < 0) len = 0;
 			if (len > E.screencols) len = E.screencols;
-			abAppend(ab, &E.row[filerow].render[E.coloff], len);
+			abAppend(ab, &row->render[B->coloff], len);
 		}
 		abAppend(ab, "\x1b[K", 3);
 		/* if (y < E.screenrows - 1) abAppend(ab, "\r\n", 2); */
@@ -461,8 +2552,18 @@ void editorDrawRows(struct abuf *ab){
 void editorDrawStatusBar(struct abuf *ab){
 	abAppend(ab, "\x1b[7m", 4);
 	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.nrows, E.dirty ? "(modified)" : "");	
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.nrows);
+	char bufno[32] = "";
+	if (E.nbufs > 1) snprintf(bufno, sizeof(bufno), "[%d/%d] ", E.curbuf + 1, E.nbufs);
+	int len, rlen;
+	if (B->hex){
+		len = snprintf(status, sizeof(status), "%s%.20s - %zu bytes (hex) %s", bufno, B->filename, B->hexsize, B->dirty ? "(modified)" : "");
+		rlen = snprintf(rstatus, sizeof(rstatus), "0x%zx/0x%zx", B->hexcur, B->hexsize);
+	} else {
+		char filter[48] = "";
+		if (B->filter) snprintf(filter, sizeof(filter), " [%zd match \"%.16s\"]", B->nf, B->filter);
+		len = snprintf(status, sizeof(status), "%s%.20s - %zd lines%s %s", bufno, B->filename ? B->filename : "[No Name]", B->nrows, filter, B->dirty ? "(modified)" : "");	
+		rlen = snprintf(rstatus, sizeof(rstatus), "%zd/%zd", B->cy + 1, B->nrows);
+	}
 	if (len > E.screencols) len = E.screencols;
 	abAppend(ab, status, len);
 	while (len < E.screencols){
@@ -496,7 +2597,17 @@ void editorRefreshScreen(){
 	editorDrawMessageBar(&ab);
 	// Cursor Position	
 	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+	if (B->hex){
+		int y, x;
+		editorHexCursor(&y, &x);
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+	} else if (B->softwrap){
+		ssize_t x;
+		ssize_t vline = editorWrapCursor(&x);
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(vline - B->vrowoff) + 1, (int)x + 1);
+	} else {
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(editorRowToView(B->cy) - B->rowoff) + 1, (int)(B->rx - B->coloff) + 1);
+	}
 	abAppend(&ab, buf, strlen(buf));
 
 	abAppend(&ab, "\x1b[?25h", 6);
@@ -507,22 +2618,305 @@ void editorRefreshScreen(){
 void editorSetStatusMessage(const char *fmt, ...){
 	va_list ap;
 	va_start(ap, fmt);
+	if (E.batch){
+		char msg[sizeof(E.statusmsg)];
+		vsnprintf(msg, sizeof(msg), fmt, ap);
+		va_end(ap);
+		fprintf(stderr, "%s: %s\n", B && B->filename ? B->filename : "kilo", msg);
+		return;
+	}
 	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
 	va_end(ap);
 	E.statusmsg_time = time(NULL);
 }	
 
+/*** line index cache ***/
+
+// Sidecar layout: header, source path, then one LEB128 varint per line
+// holding its length including the newline (the delta between starts)
+#define IDX_MAGIC "KILOIDX2"
+#define IDX_SUM_BLOCK 4096 //bytes hashed at each end of the indexed region
+
+struct idxHeader{
+	char magic[8];
+	uint64_t size;
+	int64_t mtime, mtime_nsec;
+	uint64_t ino, dev;
+	uint64_t nlines;
+	uint64_t datalen;
+	uint64_t pathlen;
+	uint64_t sum; //idxSum of the size bytes indexed
+};
+
+// Scanned line lengths, appended to the reused prefix when rewriting
+struct idxBuf{
+	unsigned char *b;
+	size_t len, cap;
+};
+
+void idxPutVarint(struct idxBuf *ib, uint64_t v){
+	if (ib->len + 10 > ib->cap){
+		ib->cap = ib->cap ? ib->cap * 2 : 4096;
+		ib->b = realloc(ib->b, ib->cap);
+		if (ib->b == NULL) bust("realloc");
+	}
+	while (v >= 0x80){
+		ib->b[ib->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	ib->b[ib->len++] = v;
+}
+
+// Returns bytes consumed, 0 on a truncated or overlong varint
+size_t idxGetVarint(const unsigned char *p, const unsigned char *end, uint64_t *v){
+	const unsigned char *start = p;
+	int shift = 0;
+	*v = 0;
+	while (p < end && shift < 64){
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) return p - start;
+		shift += 7;
+	}
+	return 0;
+}
+
+// An in-place rewrite keeps the inode, so a grown file only reuses the
+// cached lengths if the first and last block they cover are unchanged
+uint64_t idxSum(const char *data, uint64_t len){
+	uint64_t n = len < IDX_SUM_BLOCK ? len : IDX_SUM_BLOCK;
+	return fnv1a(data, n) ^ (fnv1a(data + len - n, n) * 31);
+}
+
+// $XDG_CACHE_HOME/kilo/<fnv1a of path>.idx, directories created on demand
+char *idxCachePath(const char *abspath){
+	char dir[4096];
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg && *xdg){
+		snprintf(dir, sizeof(dir), "%s", xdg);
+	} else if (home && *home){
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	} else {
+		return NULL;
+	}
+	// Create missing parents as mkdir -p does
+	char *slash;
+	for (slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')){
+		*slash = '\0';
+		mkdir(dir, 0700);
+		*slash = '/';
+	}
+	mkdir(dir, 0700);
+	size_t dirlen = strlen(dir);
+	snprintf(dir + dirlen, sizeof(dir) - dirlen, "/kilo");
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+
+	uint64_t h = fnv1a(abspath, strlen(abspath));
+	char *path = malloc(strlen(dir) + 22);
+	if (path == NULL) return NULL;
+	sprintf(path, "%s/%016llx.idx", dir, (unsigned long long)h);
+	return path;
+}
+
+void idxWrite(const char *cpath, const char *abspath, struct stat *st, uint64_t nlines, uint64_t sum,
+		struct idxBuf *lens){
+	struct idxHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IDX_MAGIC, 8);
+	hdr.size = st->st_size;
+	hdr.mtime = st->st_mtim.tv_sec;
+	hdr.mtime_nsec = st->st_mtim.tv_nsec;
+	hdr.ino = st->st_ino;
+	hdr.dev = st->st_dev;
+	hdr.nlines = nlines;
+	hdr.datalen = lens->len;
+	hdr.pathlen = strlen(abspath);
+	hdr.sum = sum;
+
+	// Write aside and rename so readers never see a partial index
+	char *tmp = malloc(strlen(cpath) + 8);
+	if (tmp == NULL) return;
+	sprintf(tmp, "%s.XXXXXX", cpath);
+	int fd = mkstemp(tmp);
+	if (fd == -1){
+		free(tmp);
+		return;
+	}
+	FILE *fp = fdopen(fd, "w");
+	int ok = fp != NULL;
+	if (ok){
+		ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+			&& fwrite(abspath, 1, hdr.pathlen, fp) == hdr.pathlen
+			&& fwrite(lens->b, 1, lens->len, fp) == lens->len;
+		if (fclose(fp) != 0) ok = 0;
+	} else {
+		close(fd);
+	}
+	if (!ok || rename(tmp, cpath) == -1) unlink(tmp);
+	free(tmp);
+}
+
+// Sidecar rewrite, on a worker when interactive since it only has to be
+// on disk by the next open
+struct idxJob{
+	char *cpath, *abspath;
+	struct stat st;
+	uint64_t nlines, sum;
+	struct idxBuf lens; //every line length, reused prefix included
+};
+
+void idxWriteJob(void *arg){
+	struct idxJob *job = arg;
+	idxWrite(job->cpath, job->abspath, &job->st, job->nlines, job->sum, &job->lens);
+}
+
+void idxJobFree(void *arg){
+	struct idxJob *job = arg;
+	free(job->cpath);
+	free(job->abspath);
+	free(job->lens.b);
+	free(job);
+}
+
+// The row stays in the mapping until something faults it in
+void editorIndexedRow(uint64_t off, size_t len){
+	const char *line = B->map + off;
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+	editorGrowRows();
+	erow *row = &B->row[B->nrows++];
+	row->size = len;
+	row->rsize = -1;
+	row->strings = NULL;
+	row->render = NULL;
+	row->store = off;
+}
+
+// Load through the sidecar: an unchanged file skips the newline scan, an
+// appended one scans only the tail. The mapping stays as the rows' backing
+// store, so their text is only read when used; a file truncated behind
+// our back faults with SIGBUS, as any mapped file does. Returns -1 to fall
+// back to getline.
+int editorOpenIndexed(char *filename){
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) return -1;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0){
+		close(fd);
+		return -1;
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return -1;
+	char *abspath = realpath(filename, NULL);
+	char *cpath = abspath ? idxCachePath(abspath) : NULL;
+	if (cpath == NULL){
+		free(abspath);
+		munmap(data, st.st_size);
+		return -1;
+	}
+
+	// Map the sidecar and decide how much of it still applies
+	unsigned char *map = NULL;
+	size_t maplen = 0;
+	const unsigned char *p = NULL, *end = NULL;
+	uint64_t nlines = 0;
+	int full = 0;
+	int ifd = open(cpath, O_RDONLY);
+	struct stat ist;
+	if (ifd != -1 && fstat(ifd, &ist) == 0 && (size_t)ist.st_size >= sizeof(struct idxHeader)){
+		maplen = ist.st_size;
+		map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, ifd, 0);
+		if (map == MAP_FAILED) map = NULL;
+	}
+	if (ifd != -1) close(ifd);
+	if (map){
+		struct idxHeader hdr;
+		memcpy(&hdr, map, sizeof(hdr));
+		size_t pathlen = strlen(abspath);
+		int same = memcmp(hdr.magic, IDX_MAGIC, 8) == 0
+			&& hdr.ino == (uint64_t)st.st_ino && hdr.dev == (uint64_t)st.st_dev
+			&& hdr.pathlen == pathlen
+			&& sizeof(hdr) + hdr.pathlen + hdr.datalen <= maplen
+			&& memcmp(map + sizeof(hdr), abspath, pathlen) == 0;
+		same = same && hdr.size <= (uint64_t)st.st_size && hdr.sum == idxSum(data, hdr.size);
+		full = same && hdr.size == (uint64_t)st.st_size
+			&& hdr.mtime == st.st_mtim.tv_sec && hdr.mtime_nsec == st.st_mtim.tv_nsec;
+		if (full || (same && hdr.size < (uint64_t)st.st_size)){
+			p = map + sizeof(hdr) + pathlen;
+			end = p + hdr.datalen;
+			nlines = hdr.nlines;
+		}
+	}
+
+	B->map = data;
+	B->maplen = st.st_size;
+	uint64_t off = 0;
+	uint64_t n = 0;
+	const unsigned char *prefix = p;
+	while (p && n < nlines){
+		uint64_t len;
+		size_t used = idxGetVarint(p, end, &len);
+		if (used == 0 || len == 0 || len > (uint64_t)st.st_size - off) break;
+		// An unterminated last line may have grown, rescan it
+		if (!full && data[off + len - 1] != '\n') break;
+		editorIndexedRow(off, len);
+		off += len;
+		p += used;
+		n++;
+	}
+	size_t prefixlen = p ? (size_t)(p - prefix) : 0;
+
+	struct idxBuf tail = {NULL, 0, 0};
+	while (off < (uint64_t)st.st_size){
+		char *nl = memchr(&data[off], '\n', st.st_size - off);
+		uint64_t len = nl ? (uint64_t)(nl - &data[off]) + 1 : st.st_size - off;
+		editorIndexedRow(off, len);
+		idxPutVarint(&tail, len);
+		off += len;
+		n++;
+	}
+	if (!full || tail.len){
+		struct idxJob *job = malloc(sizeof(*job));
+		if (job == NULL) bust("malloc");
+		job->cpath = cpath;
+		job->abspath = abspath;
+		job->st = st;
+		job->nlines = n;
+		job->sum = idxSum(data, st.st_size);
+		// The reused prefix lives in the old sidecar's mapping, unmapped below
+		job->lens.len = job->lens.cap = prefixlen + tail.len;
+		job->lens.b = malloc(job->lens.cap ? job->lens.cap : 1);
+		if (job->lens.b == NULL) bust("malloc");
+		if (prefixlen) memcpy(job->lens.b, prefix, prefixlen);
+		if (tail.len) memcpy(job->lens.b + prefixlen, tail.b, tail.len);
+		if (E.batch){
+			idxWriteJob(job);
+			idxJobFree(job);
+		} else {
+			schedSubmitJob(idxWriteJob, idxJobFree, job);
+		}
+		cpath = abspath = NULL;
+	}
+
+	free(tail.b);
+	if (map) munmap(map, maplen);
+	free(cpath);
+	free(abspath);
+	return 0;
+}
+
 /*** file i/o ***/
 
-void editorUpdateRow(erow *row){
-	int tabs = 0;
-	int j;
+// Rebuild render from strings, without the edit hooks
+void editorRenderRow(erow *row){
+	ssize_t tabs = 0;
+	ssize_t j;
 	for (j = 0; j < row->size; j++)
 		if (row->strings[j] == '\t') tabs++;
-	free(row->render);
-	row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
+	poolFree(row->render);
+	row->render = poolAlloc(row->size + tabs * (TAB_STOP - 1) + 1);
 
-	int idx = 0;
+	ssize_t idx = 0;
 	for (j = 0; j < row->size; j++){
 		if (row->strings[j] == '\t'){
 			row->render[idx++] = ' ';
@@ -535,108 +2929,447 @@ void editorUpdateRow(erow *row){
 	row->rsize = idx;
 }
 
-char *editorRowsToString(int *buflen){
-	int ttlen = 0;
-	int j;
-	for (j = 0; j < E.nrows; j++) 
-		ttlen += E.row[j].size + 1;
-	*buflen = ttlen;
-	char *buf = malloc(ttlen);
-	char *p = buf;
-	for (j = 0; j < E.nrows; j++){
-		memcpy(p, E.row[j].strings, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
-	}
-	return buf;
+void editorUpdateRow(erow *row){
+	ssize_t oldrsize = row->rsize;
+	editorWordsRow(row, -1);
+	editorRenderRow(row);
+	row->store = -1;
+	editorWrapUpdateRow(row, oldrsize);
+	editorFilterUpdateRow(row);
+	editorWordsRow(row, 1);
 }
 
-void editorSave(){
-	if (E.filename == NULL) return;
-	int len;
-	char *buf = editorRowsToString(&len);
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1){
-		if (ftruncate(fd, len) != -1){
-			if (write(fd, buf, len) == len){
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
+// Stream the rows through a fixed buffer so saving needs no copy of the
+// file; rows not in memory are copied from the mapping or swap file
+int editorWriteRows(int fd){
+	size_t cap = 1 << 20, used = 0;
+	off_t off = 0;
+	char *buf = malloc(cap);
+	if (buf == NULL) return -1;
+	int ok = 1;
+	ssize_t j;
+	for (j = 0; ok && j < B->nrows; j++){
+		erow *row = &B->row[j];
+		size_t done = 0;
+		while (ok){
+			if (used == cap){
+				ok = ioFull(fd, 1, buf, used, off) == 0;
+				off += used;
+				used = 0;
+				continue;
 			}
+			if (done == (size_t)row->size){
+				buf[used++] = '\n';
+				break;
+			}
+			size_t n = row->size - done;
+			if (n > cap - used) n = cap - used;
+			if (row->strings) memcpy(buf + used, row->strings + done, n);
+			else if ((size_t)row->store < B->maplen) memcpy(buf + used, B->map + row->store + done, n);
+			else ok = ioFull(E.swapfd, 0, buf + used, n, row->store - B->maplen + done) == 0;
+			used += n;
+			done += n;
 		}
-		close(fd);
 	}
+	if (ok) ok = ioFull(fd, 1, buf, used, off) == 0;
 	free(buf);
+	return ok ? 0 : -1;
+}
+
+// Rows still read from the file's mapping would see their own output,
+// so write a copy and rename it over; the mapping keeps the old inode.
+// A symlink is followed so the link itself survives.
+int editorSaveReplace(){
+	char *path = realpath(B->filename, NULL);
+	if (path == NULL) path = strdup(B->filename);
+	char *tmp = path ? malloc(strlen(path) + 8) : NULL;
+	if (tmp == NULL){
+		free(path);
+		return -1;
+	}
+	sprintf(tmp, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd == -1){
+		free(tmp);
+		free(path);
+		return -1;
+	}
+	struct stat st;
+	int ok = (stat(path, &st) == -1 || fchmod(fd, st.st_mode & 07777) == 0) && editorWriteRows(fd) == 0;
+	if (close(fd) != 0) ok = 0;
+	if (ok && rename(tmp, path) == -1) ok = 0;
+	if (!ok){
+		int saved = errno;
+		unlink(tmp);
+		errno = saved;
+	}
+	free(tmp);
+	free(path);
+	return ok ? 0 : -1;
+}
+
+void editorSave(){
+	if (B->filename == NULL) return;
+	if (B->hex){
+		editorHexSave();
+		return;
+	}
+	editorRowUndoDiscard();
+	size_t len = 0;
+	ssize_t j;
+	for (j = 0; j < B->nrows; j++) len += B->row[j].size + 1;
+	int ok;
+	if (B->map){
+		ok = editorSaveReplace() == 0;
+	} else {
+		int fd = open(B->filename, O_RDWR | O_CREAT, 0644);
+		ok = fd != -1 && ftruncate(fd, len) != -1 && editorWriteRows(fd) == 0;
+		if (fd != -1) close(fd);
+	}
+	if (ok){
+		B->dirty = 0;
+		editorSetStatusMessage("%zu bytes written to disk", len);
+		return;
+	}
 	editorSetStatusMessage("Can't write to file I/O error: %s", strerror(errno));
 }
 
 //Append new line into row
 void editorAppendRow(char *s, size_t len){
-	E.row = realloc(E.row, sizeof(erow) * (E.nrows + 1));
-	int idx = E.nrows;
-	E.row[idx].size = len;
-	E.row[idx].strings = malloc(len + 1);
-	memcpy(E.row[idx].strings, s, len);
-	E.row[idx].strings[len] = '\0';
-	E.row[idx].rsize = 0;
-	E.row[idx].render = NULL;
-	editorUpdateRow(&E.row[idx]);
-	E.nrows++;
-	E.dirty++;
-}
-
-void editorOpen(char *filename){
+	editorGrowRows();
+	ssize_t idx = B->nrows;
+	B->row[idx].size = len;
+	B->row[idx].strings = poolAlloc(len + 1);
+	memcpy(B->row[idx].strings, s, len);
+	B->row[idx].strings[len] = '\0';
+	B->row[idx].rsize = 0;
+	B->row[idx].render = NULL;
+	B->row[idx].store = -1;
+	B->wraptotal++;
+	editorUpdateRow(&B->row[idx]);
+	B->nrows++;
+	B->dirty++;
+}
+
+int editorOpen(char *filename){
 	/* char *line = "Hello, world!"; */
 	/* ssize_t len = 13; */
-	/* E.row.size = len; */
-	/* E.row.strings = malloc(len + 1); */
-	/* memcpy(E.row.strings, line, len); */
-	/* E.row.strings[len] = '\0'; */
-	/* E.nrows = 1; */
-	free(E.filename);
-	E.filename = strdup(filename);
+	/* B->row.size = len; */
+	/* B->row.strings = malloc(len + 1); */
+	/* memcpy(B->row.strings, line, len); */
+	/* B->row.strings[len] = '\0'; */
+	/* B->nrows = 1; */
+	if (B->filename != filename){
+		free(B->filename);
+		B->filename = strdup(filename);
+	}
+	B->loaded = 1;
+	if (!E.batch && editorOpenHex(filename) == 0) return 0;
+	if (E.idxcache && editorOpenIndexed(filename) == 0){
+		B->dirty = 0;
+		return 0;
+	}
 	FILE *fp = fopen(filename, "r");
-	if (!fp) bust("fopen");
+	if (!fp){
+		// Interactively the buffer stays empty under this name, so a
+		// missing file is created by the first save
+		if (!E.batch && errno == ENOENT) editorSetStatusMessage("New file: %s", filename);
+		else editorSetStatusMessage("Can't open: %s", strerror(errno));
+		return -1;
+	}
 	char *line = NULL;
 	size_t linecap = 0;
 	ssize_t linelen;
 	while((linelen = getline(&line, &linecap, fp)) != -1) {
 		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
-		editorInsertRow(E.nrows, line, linelen);
+		editorInsertRow(B->nrows, line, linelen);
+		if (B->nrows % SPILL_EVERY == 0) editorSpillCold();
+	}
+	free(line);
+	fclose(fp);
+	B->dirty = 0;
+	return 0;
+}
+
+/*** buffers ***/
+
+// Buffers other than the first are loaded on first switch
+struct editorBuffer *editorBufferNew(const char *filename){
+	struct editorBuffer *buf = calloc(1, sizeof(*buf));
+	if (buf == NULL) bust("calloc");
+	buf->spillhi = -1;
+	if (filename) buf->filename = strdup(filename);
+	else buf->loaded = 1;
+	struct editorBuffer **bufs = realloc(E.bufs, sizeof(*bufs) * (E.nbufs + 1));
+	if (bufs == NULL) bust("realloc");
+	E.bufs = bufs;
+	E.bufs[E.nbufs++] = buf;
+	return buf;
+}
+
+// Returns -1 if the buffer's file could not be read, the message says why
+int editorSwitchBuffer(int i){
+	if (E.nbufs == 0) return 0;
+	E.curbuf = (i % E.nbufs + E.nbufs) % E.nbufs;
+	B = E.bufs[E.curbuf];
+	if (!B->loaded) return editorOpen(B->filename);
+	return 0;
+}
+
+int editorAnyDirty(){
+	int i;
+	for (i = 0; i < E.nbufs; i++)
+		if (E.bufs[i]->dirty) return 1;
+	return 0;
+}
+
+/*** batch ***/
+
+// One script line: s/from/to/, d N, i N text or a text
+struct batchCmd{
+	char op;
+	ssize_t line;
+	char *a;
+	size_t alen;
+	char *b;
+	size_t blen;
+};
+
+struct batchJob{
+	char *filename;
+	struct batchCmd *cmds;
+	int ncmds;
+	int failed;
+};
+
+int batchParseLine(char *line, struct batchCmd *cmd){
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->op = line[0];
+	switch (line[0]){
+		case 's':
+			{
+				// Any delimiter, as in sed: s|a/b|c|
+				char delim = line[1];
+				if (delim == '\0') return -1;
+				char *from = &line[2];
+				char *mid = strchr(from, delim);
+				if (mid == NULL) return -1;
+				char *to = mid + 1;
+				char *end = strchr(to, delim);
+				if (end == NULL) return -1;
+				cmd->a = strndup(from, mid - from);
+				cmd->alen = mid - from;
+				cmd->b = strndup(to, end - to);
+				cmd->blen = end - to;
+				return cmd->alen ? 0 : -1;
+			}
+		case 'd':
+		case 'i':
+			{
+				char *rest;
+				cmd->line = strtol(&line[1], &rest, 10);
+				if (rest == &line[1] || cmd->line < 1) return -1;
+				if (line[0] == 'i'){
+					if (*rest == ' ') rest++;
+					cmd->a = strdup(rest);
+					cmd->alen = strlen(rest);
+				}
+				return 0;
+			}
+		case 'a':
+			{
+				char *rest = &line[1];
+				if (*rest == ' ') rest++;
+				cmd->a = strdup(rest);
+				cmd->alen = strlen(rest);
+				return 0;
+			}
+	}
+	return -1;
+}
+
+int batchParseScript(const char *path, struct batchCmd **cmds){
+	FILE *fp = fopen(path, "r");
+	if (!fp){
+		perror(path);
+		return -1;
+	}
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int n = 0;
+	int lineno = 0;
+	*cmds = NULL;
+	while ((linelen = getline(&line, &linecap, fp)) != -1){
+		lineno++;
+		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) line[--linelen] = '\0';
+		if (linelen == 0 || line[0] == '#') continue;
+		*cmds = realloc(*cmds, sizeof(struct batchCmd) * (n + 1));
+		if (*cmds == NULL) bust("realloc");
+		if (batchParseLine(line, &(*cmds)[n]) == -1){
+			fprintf(stderr, "%s:%d: bad command: %s\n", path, lineno, line);
+			n = -1;
+			break;
+		}
+		n++;
 	}
 	free(line);
 	fclose(fp);
-	E.dirty = 0;
+	return n;
+}
+
+// Runs on a pool worker with a private buffer and row pool
+void batchRunFile(void *arg){
+	struct batchJob *job = arg;
+	struct editorBuffer buf;
+	struct rowPool pool;
+	char *scratch = NULL;
+	size_t cap = 0;
+	memset(&buf, 0, sizeof(buf));
+	memset(&pool, 0, sizeof(pool));
+	B = &buf;
+	P = &pool;
+	if (editorOpen(job->filename) == -1){
+		job->failed = 1;
+	} else {
+		int i;
+		ssize_t j;
+		for (i = 0; i < job->ncmds; i++){
+			struct batchCmd *cmd = &job->cmds[i];
+			switch (cmd->op){
+				case 's':
+					// Only rows that match are faulted in from the mapping
+					for (j = 0; j < B->nrows; j++){
+						erow *row = &B->row[j];
+						const char *text = editorRowText(B, row, 0, row->size, &scratch, &cap);
+						if (memmem(text, row->size, cmd->a, cmd->alen))
+							editorRowReplaceAll(editorRow(j), cmd->a, cmd->alen, cmd->b, cmd->blen);
+					}
+					break;
+				case 'd':
+					editorDelRow(cmd->line - 1);
+					break;
+				case 'i':
+					editorInsertRow(cmd->line - 1 > B->nrows ? B->nrows : cmd->line - 1, cmd->a, cmd->alen);
+					break;
+				case 'a':
+					editorInsertRow(B->nrows, cmd->a, cmd->alen);
+					break;
+			}
+		}
+		if (B->dirty){
+			editorSave();
+			if (B->dirty) job->failed = 1;
+		}
+	}
+	ssize_t j;
+	for (j = 0; j < B->nrows; j++) editorFreeRow(&B->row[j]);
+	free(B->row);
+	free(B->wrapidx);
+	free(B->filename);
+	free(scratch);
+	if (B->map) munmap(B->map, B->maplen);
+	poolDestroy(&pool);
+	B = NULL;
+	P = NULL;
+}
+
+// Apply script to every file without touching the terminal
+int editorBatch(const char *script, char **files, int nfiles, int nthreads){
+	struct batchCmd *cmds;
+	int ncmds = batchParseScript(script, &cmds);
+	if (ncmds == -1) return 1;
+	E.batch = 1;
+	struct batchJob *jobs = calloc(nfiles, sizeof(struct batchJob));
+	if (jobs == NULL && nfiles) bust("calloc");
+	struct tpool *pool = tpoolCreate(nthreads < nfiles ? nthreads : nfiles);
+	int i;
+	for (i = 0; i < nfiles; i++){
+		jobs[i].filename = files[i];
+		jobs[i].cmds = cmds;
+		jobs[i].ncmds = ncmds;
+		tpoolSubmit(pool, batchRunFile, &jobs[i]);
+	}
+	tpoolWait(pool);
+	tpoolDestroy(pool);
+	int failed = 0;
+	for (i = 0; i < nfiles; i++) failed += jobs[i].failed;
+	for (i = 0; i < ncmds; i++){
+		free(cmds[i].a);
+		free(cmds[i].b);
+	}
+	free(cmds);
+	free(jobs);
+	return failed ? 1 : 0;
 }
 
 /*** init ***/
 
+void handleSigWinch(int sig){
+	(void)sig;
+	E.winch = 1;
+}
+
+// Re-read the window size; the wrap index notices the new width lazily
+void editorHandleResize(){
+	E.winch = 0;
+	if (getWindowSize(&E.screenrows, &E.screencols) == -1) bust("getWindowSize");
+	E.screenrows -= 2;
+	editorRefreshScreen();
+}
+
 void initEditor(){
-	E.cx = 0;
-	E.rx = 0;
-	E.cy = 0;
-	E.rowoff = 0;
-	E.coloff = 0;
-	E.row = NULL;
-	E.nrows = 0;
-	E.dirty = 0;
-	E.filename = NULL;
+	E.winch = 0;
+	E.bufs = NULL;
+	E.nbufs = 0;
+	E.curbuf = 0;
+	E.batch = 0;
+	E.swapfd = -1;
+	E.swapend = 0;
+	memset(&E.pool, 0, sizeof(E.pool));
+	B = NULL;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
+	E.tasks = NULL;
+	E.ntasks = 0;
+	E.nexttask = 0;
+	E.workers = NULL;
+	E.done = NULL;
+	E.jobs = 0;
+	pthread_mutex_init(&E.donelock, NULL);
+	if (pipe(E.donepipe) == -1) bust("pipe");
+	fcntl(E.donepipe[0], F_SETFL, O_NONBLOCK);
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1) bust("getWindowSize");
 	E.screenrows -= 2;
+	signal(SIGWINCH, handleSigWinch);
 }
 
 int main(int argc, char *argv[]){
+	char *script = NULL;
+	int nthreads = tpoolDefaultThreads();
+	int opt;
+	while ((opt = getopt(argc, argv, "b:cj:m:")) != -1){
+		switch (opt){
+			case 'b': script = optarg; break;
+			case 'c': E.idxcache = 1; break;
+			case 'j': nthreads = atoi(optarg); break;
+			case 'm': E.membudget = (size_t)atol(optarg) << 20; break;
+			default:
+				fprintf(stderr, "Usage: kilo [-c] [-m MB] [file...]\n"
+						"       kilo -b script [-c] [-j threads] file...\n");
+				return 1;
+		}
+	}
+	if (script) return editorBatch(script, &argv[optind], argc - optind, nthreads);
+
 	enableRawMode();
 	initEditor();
-	if (argc >= 2){
-		editorOpen(argv[1]);
-	}
-	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit");
+	P = &E.pool;
+	int i;
+	for (i = optind; i < argc; i++) editorBufferNew(argv[i]);
+	if (E.nbufs == 0) editorBufferNew(NULL);
+	if (editorSwitchBuffer(0) == 0)
+		editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-W = wrap | Ctrl-B = next buffer");
 	while (1){
 		/* char c = '\0'; */
 		/* if (read(STDIN_FILENO, &c, 1) == -1 && errno != EAGAIN) bust("read"); */
@@ -648,6 +3381,7 @@ int main(int argc, char *argv[]){
 		/* } */
 		/* if (c == CTRL_KEY('q')) break; */
 
+		editorSpillCold();
 		editorRefreshScreen();
 		editorProcessKeypress();
 	}